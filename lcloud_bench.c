@@ -0,0 +1,273 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_bench.c
+//  Description    : This is a micro-benchmark for the LionCloud block cache.
+//                   It measures the cost of cache hits, misses and evicting
+//                   inserts as the number of resident blocks grows, and the
+//                   throughput of concurrent get/put for 1 to N threads.
+//
+//   Author        : Patrick McDaniel
+//   Last Modified : Thu 19 Mar 2020 09:27:55 AM EDT
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+// Project Includes
+#include <cmpsc311_log.h>
+#include <lcloud_controller.h>
+#include <lcloud_cache.h>
+
+// Defines
+#define LCLOUD_BENCH_ARGUMENTS "hn:t:"
+#define LCLOUD_BENCH_DEFAULT_OPS 1000000
+#define LCLOUD_BENCH_THREAD_BLOCKS 16384 // Cache size for the thread runs
+#define LCLOUD_BENCH_PUT_PERCENT 10      // Share of puts in the thread runs
+#define USAGE                                                       \
+    "USAGE: lcloud_bench [-h] [-n <ops>] [-t <threads>]\n"          \
+    "\n"                                                            \
+    "where:\n"                                                      \
+    "    -h - help mode (display this message)\n"                   \
+    "    -n - number of lookups to time for each cache size\n"      \
+    "    -t - run the get/put throughput test for 1..threads\n"     \
+    "\n"
+
+// Cache sizes (in blocks) the benchmark is run over
+static const int benchSizes[] = { 64, 256, 1024, 4096, 16384, 65536 };
+
+//
+// Functional Prototypes
+
+int benchCacheSize(int blocks, int ops); // Time lookups for one cache size
+
+int benchThreads(int threads, int ops); // Time concurrent get/put
+
+// Per-thread state of the throughput test
+typedef struct {
+    uint32_t seed; // Seed for the address stream
+    int ops;       // Operations to run
+    int blocks;    // Number of resident blocks
+} benchThreadArgs;
+
+//
+// Functions
+
+// Get the current time in nanoseconds
+static uint64_t benchNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+// Spread a block number over the (did, sec, blk) space
+static void benchAddress(uint32_t n, LcDeviceId *did, uint16_t *sec, uint16_t *blk) {
+    *did = (LcDeviceId)(n % 16);
+    *sec = (uint16_t)((n / 16) / 64);
+    *blk = (uint16_t)((n / 16) % 64);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the cache benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful test, -1 if failure
+
+int main(int argc, char* argv[])
+{
+    int ch, ops = LCLOUD_BENCH_DEFAULT_OPS, threads = 0;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, LCLOUD_BENCH_ARGUMENTS)) != -1) {
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'n': // Number of lookups
+            ops = atoi(optarg);
+            break;
+
+        case 't': // Threads for the throughput test
+            threads = atoi(optarg);
+            if (threads <= 0) {
+                fprintf(stderr, "Bad number of threads, aborting.\n");
+                return (-1);
+            }
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+    if (ops <= 0) {
+        fprintf(stderr, "Bad number of operations, aborting.\n");
+        return (-1);
+    }
+
+    initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    printf("%10s %14s %14s %14s\n", "blocks", "hit (ns/op)", "miss (ns/op)", "evict (ns/op)");
+    for (int i = 0; i < sizeof(benchSizes) / sizeof(benchSizes[0]); i++) {
+        if (benchCacheSize(benchSizes[i], ops)) {
+            return (-1);
+        }
+    }
+    if (threads > 0) {
+        printf("\n%10s %16s\n", "threads", "get/put (ops/s)");
+        for (int i = 1; i <= threads; i++) {
+            if (benchThreads(i, ops)) {
+                return (-1);
+            }
+        }
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchCacheSize
+// Description  : Fill a cache of the given size and time hits, misses and
+//                inserts that evict
+//
+// Inputs       : blocks - the number of resident blocks
+//                ops - the number of lookups to time
+// Outputs      : 0 if successful, -1 if failure
+
+int benchCacheSize(int blocks, int ops) {
+    char block[LC_DEVICE_BLOCK_SIZE];
+    LcDeviceId did;
+    uint16_t sec, blk;
+    uint64_t start, hitTime, missTime, evictTime;
+    uint32_t found = 0;
+
+    // One shard, so every inserted block stays resident
+    memset(block, 'x', sizeof(block));
+    if (lcloud_initcache_sharded(blocks, 1)) {
+        fprintf(stderr, "Cache init failed for %d blocks, aborting.\n", blocks);
+        return (-1);
+    }
+    for (int i = 0; i < blocks; i++) {
+        benchAddress(i, &did, &sec, &blk);
+        lcloud_putcache(did, sec, blk, block);
+    }
+
+    // Hits: stride through the resident blocks
+    start = benchNow();
+    for (int i = 0; i < ops; i++) {
+        benchAddress((uint32_t)((uint64_t)i * 7919 % blocks), &did, &sec, &blk);
+        found += (lcloud_getcache(did, sec, blk) != NULL);
+    }
+    hitTime = benchNow() - start;
+
+    // Misses: addresses past the resident range
+    start = benchNow();
+    for (int i = 0; i < ops; i++) {
+        benchAddress(blocks + (uint32_t)((uint64_t)i * 7919 % blocks), &did, &sec, &blk);
+        found += (lcloud_getcache(did, sec, blk) != NULL);
+    }
+    missTime = benchNow() - start;
+
+    // Inserts into a full cache: each one evicts the LRU line
+    start = benchNow();
+    for (int i = 0; i < ops; i++) {
+        benchAddress(blocks + i, &did, &sec, &blk);
+        lcloud_putcache(did, sec, blk, block);
+    }
+    evictTime = benchNow() - start;
+
+    lcloud_closecache();
+    if (found != ops) {
+        fprintf(stderr, "Cache returned %u hits for %d lookups, aborting.\n", found, ops);
+        return (-1);
+    }
+    printf("%10d %14.1f %14.1f %14.1f\n", blocks, (double)hitTime / ops, (double)missTime / ops,
+        (double)evictTime / ops);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchThreadMain
+// Description  : Run a random mix of gets and puts over the resident blocks
+//
+// Inputs       : arg - the benchThreadArgs for this thread
+// Outputs      : NULL
+
+static void *benchThreadMain(void *arg) {
+    benchThreadArgs *args = (benchThreadArgs *)arg;
+    char block[LC_DEVICE_BLOCK_SIZE];
+    uint32_t x = args->seed;
+    LcDeviceId did;
+    uint16_t sec, blk;
+
+    memset(block, 'y', sizeof(block));
+    for (int i = 0; i < args->ops; i++) {
+        // xorshift keeps the address stream cheap and per-thread
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        benchAddress(x % args->blocks, &did, &sec, &blk);
+        if (x % 100 < LCLOUD_BENCH_PUT_PERCENT) {
+            lcloud_putcache(did, sec, blk, block);
+        } else {
+            lcloud_readcache(did, sec, blk, block);
+        }
+    }
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchThreads
+// Description  : Time concurrent gets and puts on a full cache
+//
+// Inputs       : threads - the number of threads to run
+//                ops - the number of operations per thread
+// Outputs      : 0 if successful, -1 if failure
+
+int benchThreads(int threads, int ops) {
+    char block[LC_DEVICE_BLOCK_SIZE];
+    pthread_t tids[threads];
+    benchThreadArgs args[threads];
+    LcDeviceId did;
+    uint16_t sec, blk;
+    uint64_t start, elapsed;
+
+    memset(block, 'x', sizeof(block));
+    if (lcloud_initcache(LCLOUD_BENCH_THREAD_BLOCKS)) {
+        fprintf(stderr, "Cache init failed, aborting.\n");
+        return (-1);
+    }
+    for (int i = 0; i < LCLOUD_BENCH_THREAD_BLOCKS; i++) {
+        benchAddress(i, &did, &sec, &blk);
+        lcloud_putcache(did, sec, blk, block);
+    }
+
+    start = benchNow();
+    for (int i = 0; i < threads; i++) {
+        args[i].seed = 2463534242u + i * 7919;
+        args[i].ops = ops;
+        args[i].blocks = LCLOUD_BENCH_THREAD_BLOCKS;
+        if (pthread_create(&tids[i], NULL, benchThreadMain, &args[i])) {
+            fprintf(stderr, "Thread create failed, aborting.\n");
+            return (-1);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    elapsed = benchNow() - start;
+
+    lcloud_closecache();
+    printf("%10d %16.0f\n", threads, (double)threads * ops * 1000000000.0 / elapsed);
+    return (0);
+}
@@ -8,22 +8,80 @@
 //   Last Modified : Thu 19 Mar 2020 09:27:55 AM EDT
 //
 
-// Includes 
+// Includes
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
 #include <lcloud_cache.h>
 
+// Defines
+#define LC_CACHE_NIL -1
+#define LC_CACHE_MINBUCKETS 64
+#define LC_CACHE_HASH_MULT (uint64_t)0x9e3779b97f4a7c15
+#define LC_CACHE_MAXLISTS 8         // Most resident lists a policy can use
+#define LC_CACHE_LFU_AGING 8        // LFU halves counts every 8x capacity misses
+#define LC_CACHE_MINOWNERS 16       // Initial size of a shard's owner table
+#define LC_CACHE_MAXOWNERS 1024     // Most owners (open files) a shard tracks
+#define LC_CACHE_ZALIGN 4           // Compressed tier entry alignment
+#define LC_CACHE_ZWRAP 0xffff       // Entry length marking the end of the ring
+#define LC_CACHE_ZNODEBYTES 64      // Ring bytes per index node
+#define LC_CACHE_ZGROUP 7           // Payload characters per packed group
+#define LC_CACHE_ZGROUPBITS 46      // Bits per packed group (91^7 < 2^46)
+#define LC_CACHE_SAMPLEKEYS 4096    // Most keys the sizing sampler tracks
+#define LC_CACHE_SAMPLEMOD (1 << 24) // Range of the sampling hash
+#define LC_CACHE_SAMPLEBINS 128     // Reuse distance histogram bins
+#define LC_CACHE_SAMPLEEPOCH 1024   // Sampled references between resizes
+#define LC_CACHE_ADAPTSLACK 0.01    // Miss ratio traded away to save memory
+#define LC_CACHE_SNAPSHOT_MAGIC (uint64_t)0x3150414e5343434c // "LCCSNAP1"
+#define LC_CACHE_SNAPSHOT_VERSION 1
+#define LC_CACHE_FNV_OFFSET (uint64_t)0xcbf29ce484222325
+#define LC_CACHE_FNV_PRIME (uint64_t)0x100000001b3
+
+// Resident lists used by the policies
+#define LC_LIST_LRU 0               // LRU: the one list
+#define LC_LIST_A1IN 0              // 2Q: first-touch FIFO
+#define LC_LIST_AM 1                // 2Q: re-referenced LRU
+#define LC_LIST_T1 0                // ARC: seen once recently
+#define LC_LIST_T2 1                // ARC: seen at least twice recently
+
+// Ghost lists used by the policies (keys only, no data)
+#define LC_GHOST_A1OUT 0            // 2Q: recently evicted from A1in
+#define LC_GHOST_B1 0               // ARC: recently evicted from T1
+#define LC_GHOST_B2 1               // ARC: recently evicted from T2
+
+//
+// Static Data
+
+const char *LC_CACHE_POLICY_LABELS[LC_CACHE_MAXPOLICY] = {
+    "lru", "2q", "arc", "lfu"
+};
 
 // User defined structs
 ////////////////////////////////////////////////////////////////////////////////
 
-// Cache line (doubly linked-list)
+// Cache line (doubly linked-list, linked by index into the slab)
 typedef struct listNode {
 
-    struct listNode* prev;
-    struct listNode* next;
+    int32_t prev;
+    int32_t next;               // Next line in its list (or free list)
+    int32_t hnext;              // Next line in the same hash bucket
+    uint64_t key;               // Packed (did, sec, blk)
+    uint8_t list;               // Which resident list the line is on
+    uint8_t dirty;              // Modified since read from the device
+    uint16_t freq;              // Reference count (LFU)
+    uint16_t pins;              // Readers holding the line (not evictable)
+    uint32_t owner;             // File handle that brought the line in
+    int32_t oprev;              // Owner's lines (most recently used first
+    int32_t onext;              //   with file quotas on)
     LcDeviceId did;
     uint16_t sec;
     uint16_t blk;
@@ -31,23 +89,321 @@ typedef struct listNode {
 
 } listNode;
 
-// Cache linked-list storing lines of cached data
+// Head/tail of a list of lines or ghosts
+typedef struct lcList {
+    int32_t head;               // Most recently inserted
+    int32_t tail;               // Least recently inserted
+    int count;
+} lcList;
+
+// Ghost entry, remembers the key of a recently evicted line
+typedef struct ghostNode {
+    int32_t prev;
+    int32_t next;
+    int32_t hnext;
+    uint64_t key;
+    uint8_t list;
+} ghostNode;
+
+// Ghost lists and their index (2Q and ARC only)
+typedef struct lcGhosts {
+    ghostNode* nodes;
+    int32_t* buckets;
+    uint32_t nbuckets;
+    int32_t freelist;
+    lcList lists[2];
+    int capacity;
+} lcGhosts;
+
+// Compressed tier index node (entry data lives in the ring)
+typedef struct zNode {
+    uint64_t key;
+    int32_t hnext;              // Next node in the bucket (or free list)
+    uint32_t off;               // Offset of the entry in the ring
+} zNode;
+
+// Compressed tier ring entry header, followed by len bytes of data
+typedef struct zEntry {
+    int32_t node;               // Index node, LC_CACHE_NIL if dropped
+    uint16_t len;               // Data bytes, LC_CACHE_ZWRAP at the ring end
+    uint16_t unused;
+} zEntry;
+
+// Compressed tier: a log-structured ring of compressed clean lines that
+// were evicted, oldest at the tail, with a hash index by key
+typedef struct lcZTier {
+    uint8_t* ring;
+    uint32_t size;              // Ring bytes (0 when the tier is off)
+    uint32_t head;              // Where the next entry goes
+    uint32_t tail;              // Oldest entry
+    uint32_t used;              // Ring bytes in use (entries and padding)
+    zNode* nodes;
+    int32_t* buckets;
+    uint32_t nbuckets;
+    int32_t freelist;
+    int capacity;               // Index nodes
+    int count;                  // Entries indexed
+} lcZTier;
+
+// Local disk cache slot index (the block itself is in the mapped file)
+typedef struct l2Slot {
+    uint64_t key;
+    int32_t hnext;              // Next slot in the bucket
+    uint8_t used;
+    uint8_t ref;                // CLOCK reference bit
+    uint16_t unused;
+} l2Slot;
+
+// Local disk cache: a shard's region of the memory-mapped file, replaced
+// by CLOCK (second chance)
+typedef struct lcL2 {
+    char* data;                 // nslots blocks in the mapped file
+    l2Slot* slots;
+    int32_t* buckets;
+    uint32_t nbuckets;
+    int nslots;                 // 0 when there is no local disk cache
+    int hand;                   // CLOCK hand
+} lcL2;
+
+// Compressed tier codes of the payload characters (LC_CACHE_ZNOCODE if none)
+#define LC_CACHE_ZNOCODE 0xff
+static const char zChars[] = CMPSC311_ALLCHARS;
+static uint8_t zCharCode[256];
+
+// Owner of lines: an open file handle, charged for its accesses and lines
+typedef struct lcOwner {
+    uint32_t key;               // File handle, LC_CACHE_NOOWNER if unused
+    int32_t hnext;              // Next owner in the same bucket (or free list)
+    int32_t heappos;            // Place in the shard's owner heap
+    LcCacheCounters stats;      // Statistics of the owner
+    lcList lines;               // Resident lines charged to the owner
+} lcOwner;
+
+// Cache linked-list storing lines of cached data (one per shard)
 typedef struct linkedList {
-    listNode* head;
-    listNode* tail;
-    int maxblocks;
+    pthread_mutex_t lock;       // Protects everything in the shard
+    listNode* lines;            // Slab of slabblocks lines (mmap'd)
+    int32_t* buckets;           // Hash index over the lines
+    uint32_t nbuckets;          // Number of buckets (power of 2)
+    lcList lists[LC_CACHE_MAXLISTS]; // Resident lists, meaning set by policy
+    lcGhosts ghosts;            // Ghost lists, if the policy uses them
+    lcZTier ztier;              // Compressed tier for evicted lines
+    lcL2 l2;                    // Local disk cache for evicted lines
+    int32_t freelist;           // Unused lines
+    int arcp;                   // ARC target size of T1
+    int misses;                 // LFU misses since the last aging pass
+    int maxblocks;              // Capacity now (lines below it are usable)
+    int slabblocks;             // Lines in the slab, the most maxblocks can grow to
     int currentblocks;
+    LcCacheCounters total;      // Statistics for the shard
+    LcCacheCounters device[LC_CACHE_MAXDEVICES];
+    lcOwner* owners;            // Owner table, one record per open file
+    int32_t* ownerbuckets;      // Hash index over the owners
+    uint32_t nowners;           // Records in the owner table (power of 2)
+    int32_t freeowners;         // Unused owner records
+    int32_t* ownerheap;         // Owners, most resident lines on top
+    uint32_t nheap;             // Owners in the heap
+    int activeowners;           // Owners with resident lines
 } linkedList;
 
-struct linkedList* cache;
+// Snapshot file header, followed by nlines records, oldest line first
+typedef struct lcSnapshotHeader {
+    uint64_t magic;             // LC_CACHE_SNAPSHOT_MAGIC
+    uint32_t version;           // LC_CACHE_SNAPSHOT_VERSION
+    uint32_t blocksize;         // LC_DEVICE_BLOCK_SIZE
+    uint64_t stamp;             // Device state the lines were read from
+    uint64_t checksum;          // FNV-1a over the records
+    uint32_t nlines;
+    uint32_t unused;
+} lcSnapshotHeader;
+
+// Snapshot record (one clean line)
+typedef struct lcSnapshotLine {
+    uint16_t sec;
+    uint16_t blk;
+    LcDeviceId did;
+    uint8_t unused[3];
+    char block[LC_DEVICE_BLOCK_SIZE];
+} lcSnapshotLine;
+
+// Key tracked by the sizing sampler
+typedef struct lcSampleKey {
+    uint64_t key;
+    uint32_t hash;              // Sampling hash of the key
+    uint32_t time;              // Slot of the last reference
+    int32_t hnext;              // Next key in the bucket (or free list)
+} lcSampleKey;
+
+// Online miss-ratio curve estimate (spatially hashed sampling, SHARDS).
+// Keys whose hash falls under the threshold are sampled; their reuse
+// distances, counted with a Fenwick tree over reference slots and scaled
+// by the sampling rate, fill a decaying histogram.
+typedef struct lcSampler {
+    pthread_mutex_t lock;
+    uint32_t threshold;         // Sample keys with hash below this (0 off)
+    lcSampleKey* keys;
+    int32_t* buckets;
+    uint32_t nbuckets;
+    int32_t freelist;
+    int nkeys;
+    uint32_t* fenwick;          // Referenced slots (1 per live key)
+    uint32_t window;            // Slots before the times are compacted
+    uint32_t now;               // Next slot
+    double hist[LC_CACHE_SAMPLEBINS + 1]; // Weighted references by distance
+    double cold;                // Weighted first references
+    double refs;                // Weighted references
+    int binwidth;               // Blocks per histogram bin
+    int epoch;                  // Sampled references since the last resize
+    uint64_t resizes;           // Capacity changes made
+    int capacity;               // Capacity asked for last
+    uint64_t* order;            // Scratch for compaction
+    int minblocks;              // Capacity bounds
+    int limitblocks;
+    double target;              // Target miss ratio
+} lcSampler;
+
+// Replacement policy operations
+typedef struct lcCachePolicy {
+    void (*hit)(linkedList* c, int32_t idx);
+        // A resident line was referenced
+    int32_t (*miss)(linkedList* c, uint64_t key);
+        // Get a line for a new key, evicting as needed, and place it
+    int ghosts;
+        // Size of the ghost lists as a multiple of the shard capacity
+} lcCachePolicy;
+
+// The cache, split into shards by the hash of the block address
+typedef struct lcCache {
+    linkedList* shards;
+    int nshards;                // Number of shards (power of 2)
+    int shardbits;              // log2(nshards)
+    int maxblocks;
+    int writeback;              // Absorb writes and write dirty lines later
+    int filequota;              // Percent of a full shard one file may hold
+    LcCachePolicyType type;
+    const lcCachePolicy* policy;
+    char* snapshot;             // Snapshot file (saved at close), or NULL
+    uint64_t stamp;             // Stamp written into the snapshot
+    lcSampler sampler;          // Adaptive sizing, if configured
+    char* l2map;                // Local disk cache file mapping, or NULL
+    size_t l2size;              // Bytes mapped
+} lcCache;
+
+lcCache* cache = NULL;
+LcCacheWriteback cacheWriteback = NULL;
+static __thread uint32_t cacheOwner = LC_CACHE_NOOWNER; // Charged for accesses
+extern const lcCachePolicy* lcCachePolicies[LC_CACHE_MAXPOLICY];
 //
 // Functions
-int cacheReplaceLine(listNode* node);
-int cacheAddLine(listNode* node);
+int cacheRemoveLine(linkedList* c, int32_t idx);
+int32_t cacheFreeLine(linkedList* c);
+int32_t cacheEvictLine(linkedList* c, int32_t idx);
+int32_t cacheVictim(linkedList* c, int list);
+int32_t cacheFindLine(linkedList* c, uint64_t key);
+int cacheFlushLine(linkedList* c, int32_t idx);
+static int cacheStore(LcDeviceId did, uint16_t sec, uint16_t blk, char *block, int dirty);
+static int32_t cacheInsertLine(linkedList* c, uint64_t key, LcDeviceId did, uint16_t sec,
+    uint16_t blk, const char *block, int dirty);
+static int cachePromote(linkedList* c, uint64_t key, LcDeviceId did, uint16_t sec, uint16_t blk,
+    char *block, int32_t *idx);
+static void cacheAddCounters(LcCacheCounters* to, const LcCacheCounters* from);
+int cacheInitShard(linkedList* c, int maxblocks, int slabblocks, int ghosts, uint32_t zbytes);
+int cacheResizeShard(linkedList* c, int maxblocks);
+void cacheMoveLine(linkedList* c, int32_t from, int32_t to);
+void cacheResize(int maxblocks);
+void cacheFreeShard(linkedList* c);
+int cacheAbortInit(void);
+lcOwner* cacheFindOwner(linkedList* c, uint32_t owner);
+int cacheAddOwner(linkedList* c, uint32_t owner);
+void cacheRemoveOwner(linkedList* c, uint32_t owner);
+void cacheChargeLine(linkedList* c, int32_t idx, uint32_t owner);
+void ownerHeapUp(linkedList* c, uint32_t pos);
+void ownerHeapDown(linkedList* c, uint32_t pos);
+void cacheHitLine(linkedList* c, int32_t idx);
+int32_t cacheQuotaVictim(linkedList* c, uint32_t owner);
+int ownerPush(linkedList* c, int32_t idx);
+void ownerUnlink(linkedList* c, int32_t idx);
+void cacheCount(linkedList* c, LcDeviceId did, uint32_t owner, int field);
+void cacheCountLines(linkedList* c, LcDeviceId did, uint32_t owner, int delta);
+int cacheSaveSnapshot(const char* path, uint64_t stamp);
+int cacheLoadSnapshot(const char* path, uint64_t stamp);
+
+void listPushHead(linkedList* c, int list, int32_t idx);
+void listUnlink(linkedList* c, int32_t idx);
+void listMoveHead(linkedList* c, int list, int32_t idx);
+
+int32_t ghostFind(lcGhosts* g, uint64_t key);
+void ghostPush(lcGhosts* g, int list, uint64_t key);
+void ghostRemove(lcGhosts* g, int32_t gidx);
+void ghostDropTail(lcGhosts* g, int list);
+
+int zInit(lcZTier* z, uint32_t bytes);
+int32_t zFind(lcZTier* z, uint64_t key);
+int zStore(linkedList* c, listNode* line);
+void zRemove(linkedList* c, int32_t zidx);
+int zDropTail(linkedList* c);
+int zCompress(const char* block, uint8_t* out);
+int zDecompress(const uint8_t* in, int len, char* block);
+
+int l2Open(const char* path, int l2blocks);
+int l2Init(lcL2* l2, char* data, int nslots);
+int32_t l2Find(lcL2* l2, uint64_t key);
+void l2Store(linkedList* c, listNode* line);
+void l2Remove(linkedList* c, int32_t slot);
+
+int sampleInit(lcSampler* s, const LcCacheConfig* cfg, int maxblocks, int nshards);
+void sampleFree(lcSampler* s);
+void sampleReference(lcSampler* s, uint64_t key, uint32_t hash);
+int sampleCapacity(lcSampler* s);
+
+// Counters cacheCount can bump (offsets into LcCacheCounters)
+#define LC_STAT_HITS offsetof(LcCacheCounters, hits)
+#define LC_STAT_MISSES offsetof(LcCacheCounters, misses)
+#define LC_STAT_INSERTIONS offsetof(LcCacheCounters, insertions)
+#define LC_STAT_EVICTIONS offsetof(LcCacheCounters, evictions)
+#define LC_STAT_WRITEBACKS offsetof(LcCacheCounters, writebacks)
+#define LC_STAT_ZHITS offsetof(LcCacheCounters, zhits)
+#define LC_STAT_L2HITS offsetof(LcCacheCounters, l2hits)
+
+// Pack the block address into a single hash key
+static inline uint64_t cacheKey(LcDeviceId did, uint16_t sec, uint16_t blk) {
+    return(((uint64_t)did << 32) | ((uint64_t)sec << 16) | (uint64_t)blk);
+}
+
+// Get the bucket of a key (Fibonacci hashing on the packed key)
+static inline uint32_t cacheBucket(uint64_t key, uint32_t nbuckets) {
+    return((uint32_t)((key * LC_CACHE_HASH_MULT) >> 32) & (nbuckets - 1));
+}
+
+// Get the shard of a key (top bits of the hash, disjoint from the bucket bits)
+static inline linkedList* cacheShard(uint64_t key) {
+    if (cache->shardbits == 0) {
+        return(&cache->shards[0]);
+    }
+    return(&cache->shards[(key * LC_CACHE_HASH_MULT) >> (64 - cache->shardbits)]);
+}
+
+// Feed a reference to the sizing sampler if the key is sampled (call with
+// no shard locked; it may resize the cache)
+static inline void cacheSample(uint64_t key) {
+    lcSampler* s = &cache->sampler;
+    if (s->threshold == 0) {
+        return;
+    }
+    // A hash independent of the shard and bucket bits picks the sample
+    uint64_t h = key ^ (key >> 29);
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    uint32_t hash = (uint32_t)h & (LC_CACHE_SAMPLEMOD - 1);
+    if (hash < __atomic_load_n(&s->threshold, __ATOMIC_RELAXED)) {
+        sampleReference(s, key, hash);
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lcloud_getcache
-// Description  : Search the cache for a block 
+// Description  : Search the cache for a block
 //
 // Inputs       : did - device number of block to find
 //                sec - sector number of block to find
@@ -56,32 +412,142 @@ int cacheAddLine(listNode* node);
 
 
 char * lcloud_getcache(LcDeviceId did, uint16_t sec, uint16_t blk ) {
-    listNode* node = cache->head;
-    if (node == NULL || cache->currentblocks == 0) {
+    if (cache == NULL) {
         return (NULL);
     }
-    if ((node->next == NULL) && (node->did == did) && (node->sec == sec) && (node->blk == blk)) {
-        if (cacheReplaceLine(node) != -1) {
-                return(node->block);
+    uint64_t key = cacheKey(did, sec, blk);
+    cacheSample(key);
+    linkedList* c = cacheShard(key);
+    char* block = NULL;
+
+    pthread_mutex_lock(&c->lock);
+    int32_t idx = cacheFindLine(c, key);
+    if (idx != LC_CACHE_NIL) {
+        cacheHitLine(c, idx);
+        block = c->lines[idx].block;
+        cacheCount(c, did, cacheOwner, LC_STAT_HITS);
+    } else {
+        char zblock[LC_DEVICE_BLOCK_SIZE];
+        if (cachePromote(c, key, did, sec, blk, zblock, &idx) && idx != LC_CACHE_NIL) {
+            block = c->lines[idx].block;
         }
     }
-    while (node != NULL) {
-        if ((node->did == did) && (node->sec == sec) && (node->blk == blk)) {
-            // Put the recent used block to the head of the cache (linked-list)
-            if (cacheReplaceLine(node) != -1) {
-                return(node->block);
-            }
-            return(NULL);
+    pthread_mutex_unlock(&c->lock);
+    return( block );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_readcache
+// Description  : Copy a block out of the cache (safe with concurrent callers)
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+//                block - place to copy the block to
+// Outputs      : 0 if found, -1 if not or failure
+
+int lcloud_readcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+    if (cache == NULL) {
+        return (-1);
+    }
+    uint64_t key = cacheKey(did, sec, blk);
+    cacheSample(key);
+    linkedList* c = cacheShard(key);
+    int ret = -1;
+
+    pthread_mutex_lock(&c->lock);
+    int32_t idx = cacheFindLine(c, key);
+    if (idx != LC_CACHE_NIL) {
+        cacheHitLine(c, idx);
+        memcpy(&block[0], &c->lines[idx].block[0], 256);
+        cacheCount(c, did, cacheOwner, LC_STAT_HITS);
+        ret = 0;
+    } else if (cachePromote(c, key, did, sec, blk, block, &idx)) {
+        ret = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_pincache
+// Description  : Pin a block in the cache and get a pointer to it, so the
+//                caller can read it in place without copying the block out.
+//                The line cannot be evicted until lcloud_unpincache.
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+// Outputs      : pinned cache block if found (pointer), NULL if not or failure
+
+const char * lcloud_pincache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+    if (cache == NULL) {
+        return (NULL);
+    }
+    uint64_t key = cacheKey(did, sec, blk);
+    cacheSample(key);
+    linkedList* c = cacheShard(key);
+    const char* block = NULL;
+
+    pthread_mutex_lock(&c->lock);
+    int32_t idx = cacheFindLine(c, key);
+    if (idx != LC_CACHE_NIL && c->lines[idx].pins < UINT16_MAX) {
+        cacheHitLine(c, idx);
+        cacheCount(c, did, cacheOwner, LC_STAT_HITS);
+    } else if (idx == LC_CACHE_NIL) {
+        char zblock[LC_DEVICE_BLOCK_SIZE];
+        cachePromote(c, key, did, sec, blk, zblock, &idx);
+    } else {
+        idx = LC_CACHE_NIL;
+        cacheCount(c, did, cacheOwner, LC_STAT_MISSES);
+    }
+    if (idx != LC_CACHE_NIL) {
+        c->lines[idx].pins ++;
+        block = c->lines[idx].block;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return( block );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_unpincache
+// Description  : Release a block pinned with lcloud_pincache
+//
+// Inputs       : block - the pointer lcloud_pincache returned
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_unpincache( const char *block ) {
+    if (cache == NULL || block == NULL) {
+        return (-1);
+    }
+
+    // Find the shard whose slab holds the line
+    for (int i = 0; i < cache->nshards; i++) {
+        linkedList* c = &cache->shards[i];
+        const char* first = (const char *)&c->lines[0];
+        if (block < first || block >= (const char *)&c->lines[c->slabblocks]) {
+            continue;
+        }
+        int32_t idx = (int32_t)((block - first) / sizeof(listNode));
+        int ret = -1;
+        pthread_mutex_lock(&c->lock);
+        if (c->lines[idx].block == block && c->lines[idx].pins > 0) {
+            c->lines[idx].pins --;
+            ret = 0;
         }
-        node = node->next;
+        pthread_mutex_unlock(&c->lock);
+        return (ret);
     }
-    return( NULL );
+    return (-1);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lcloud_putcache
-// Description  : Put a value in the cache 
+// Description  : Put a value in the cache
 //
 // Inputs       : did - device number of block to insert
 //                sec - sector number of block to insert
@@ -89,133 +555,2782 @@ char * lcloud_getcache(LcDeviceId did, uint16_t sec, uint16_t blk ) {
 // Outputs      : 0 if succesfully inserted, -1 if failure
 
 int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
-    listNode* node = cache->head;
-    if (cache->tail!= NULL) {
-    }
-    while (node != NULL) {
-        //printf("------------------------------node: sec:%d blk:%d\n",node->sec,node->blk );
-        if ((node->did == did) && (node->sec == sec) && (node->blk == blk)) {
-            if (cacheReplaceLine(node) != -1) {
-                memcpy(&node->block[0], &block[0], 256);
-                return(0);
+    return(cacheStore(did, sec, blk, block, 0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_writecache
+// Description  : Write a block through the cache. In write-back mode the
+//                block is only marked dirty and reaches the device when it
+//                is evicted or flushed; otherwise it is written right away.
+//
+// Inputs       : did - device number of block to write
+//                sec - sector number of block to write
+//                blk - block number of block to write
+//                block - the block data
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_writecache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+    if (cacheWriteback == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "No cache writeback function registered");
+        return(-1);
+    }
+    if (cache != NULL) {
+        cacheSample(cacheKey(did, sec, blk));
+    }
+    if (cache != NULL && cache->writeback && cacheStore(did, sec, blk, block, 1) == 0) {
+        return(0);
+    }
+    if (cacheWriteback(did, sec, blk, block) != 0) {
+        return(-1);
+    }
+    if (cache != NULL) {
+        // The device is current, so it is fine if no line could be had
+        cacheStore(did, sec, blk, block, 0);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_flushcache
+// Description  : Write every dirty line back to its device
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_flushcache( void ) {
+    int ret = 0;
+    if (cache == NULL) {
+        return(0);
+    }
+    for (int i = 0; i < cache->nshards; i++) {
+        linkedList* c = &cache->shards[i];
+        pthread_mutex_lock(&c->lock);
+        for (int32_t idx = 0; idx < c->maxblocks; idx++) {
+            if (c->lines[idx].dirty && cacheFlushLine(c, idx) != 0) {
+                ret = -1;
             }
         }
-        node = node->next;
+        pthread_mutex_unlock(&c->lock);
     }
+    return(ret);
+}
 
-    listNode* newNode = malloc(sizeof(listNode));
-    newNode->did = did;
-    newNode->sec = sec;
-    newNode->blk = blk;
-    memcpy(&newNode->block[0], &block[0], 256);
-    cacheAddLine(newNode);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_flushowner
+// Description  : Write the dirty lines of one file handle back to their
+//                devices. A dirty line is charged to the handle that last
+//                wrote it; where the handle is not tracked the whole shard
+//                is flushed instead.
+//
+// Inputs       : owner - the file handle
+// Outputs      : 0 if successful, -1 if failure
 
-    return(0);
+int lcloud_flushowner( uint32_t owner ) {
+    int ret = 0;
+    if (cache == NULL) {
+        return(0);
+    }
+    for (int i = 0; i < cache->nshards; i++) {
+        linkedList* c = &cache->shards[i];
+        pthread_mutex_lock(&c->lock);
+        lcOwner* o = cacheFindOwner(c, owner);
+        if (o != NULL) {
+            for (int32_t idx = o->lines.head; idx != LC_CACHE_NIL; idx = c->lines[idx].onext) {
+                if (c->lines[idx].dirty && cacheFlushLine(c, idx) != 0) {
+                    ret = -1;
+                }
+            }
+        } else {
+            for (int32_t idx = 0; idx < c->maxblocks; idx++) {
+                if (c->lines[idx].dirty && cacheFlushLine(c, idx) != 0) {
+                    ret = -1;
+                }
+            }
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    return(ret);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_initcache
-// Description  : Initialze the cache by setting up metadata a cache elements.
+// Function     : lcloud_dropcache
+// Description  : Forget a block the filesystem freed: the line (unless it
+//                is pinned) and the lower tier copies are dropped, and a
+//                dirty line is not written back
 //
-// Inputs       : maxblocks - the max number number of blocks 
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
 // Outputs      : 0 if successful, -1 if failure
 
-int lcloud_initcache( int maxblocks ) {
-    cache = malloc(sizeof(linkedList *));
+int lcloud_dropcache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+    if (cache == NULL) {
+        return(0);
+    }
+    uint64_t key = cacheKey(did, sec, blk);
+    linkedList* c = cacheShard(key);
 
-    cache->head = NULL;
-    cache->tail = NULL;
-    cache->maxblocks = maxblocks;
-    cache->currentblocks = 0;
-    return(1);
+    pthread_mutex_lock(&c->lock);
+    int32_t idx = cacheFindLine(c, key);
+    if (idx != LC_CACHE_NIL) {
+        c->lines[idx].dirty = 0;
+        if (c->lines[idx].pins == 0 && cacheRemoveLine(c, idx) == 0) {
+            c->lines[idx].next = c->freelist;
+            c->freelist = idx;
+        }
+    }
+    int32_t zidx = zFind(&c->ztier, key);
+    if (zidx != LC_CACHE_NIL) {
+        zRemove(c, zidx);
+    }
+    int32_t slot = l2Find(&c->l2, key);
+    if (slot != LC_CACHE_NIL) {
+        l2Remove(c, slot);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_closecache
-// Description  : Clean up the cache when program is closing
+// Function     : lcloud_cache_setowner
+// Description  : Charge the calling thread's cache accesses (and the lines
+//                they insert) to a file handle
 //
-// Inputs       : none
+// Inputs       : owner - the file handle, LC_CACHE_NOOWNER for none
 // Outputs      : 0 if successful, -1 if failure
 
-int lcloud_closecache( void ) {
-    listNode* node = cache->head;
-    listNode* next = NULL;
-    while (node != NULL) {
-        next = node->next;
-        free(node);
-        node = next;
+int lcloud_cache_setowner( uint32_t owner ) {
+    cacheOwner = owner;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cache_openowner
+// Description  : Start tracking a file handle that was just opened. Only
+//                tracked handles are charged for lines and get statistics;
+//                accesses of others count in the totals only.
+//
+// Inputs       : owner - the file handle
+// Outputs      : 0 if successful, -1 if failure (or the owner table is full)
+
+int lcloud_cache_openowner( uint32_t owner ) {
+    if (cache == NULL || owner == LC_CACHE_NOOWNER) {
+        return(-1);
+    }
+    for (int i = 0; i < cache->nshards; i++) {
+        linkedList* c = &cache->shards[i];
+        pthread_mutex_lock(&c->lock);
+        int ret = cacheAddOwner(c, owner);
+        pthread_mutex_unlock(&c->lock);
+        if (ret != 0) {
+            lcloud_cache_closeowner(owner);
+            return(-1);
+        }
     }
-    cache->head = NULL;
-    cache->tail = NULL;
-    cache->currentblocks = 0;
-    cache->maxblocks = 0;
     return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : CacheReplaceLine
-// Description  : Put current node to the head
+// Function     : lcloud_cache_closeowner
+// Description  : Stop tracking a file handle that is being closed. Its lines
+//                stay cached, charged to no one, and its statistics go.
 //
-// Inputs       : listNode* node
+// Inputs       : owner - the file handle
 // Outputs      : 0 if successful, -1 if failure
-int cacheReplaceLine(listNode* node) {
-    //printf("BLK: %d  SEC: %d\n", node->next->blk, node->next->sec);
-    if (node == NULL || cache->head == NULL) {
+
+int lcloud_cache_closeowner( uint32_t owner ) {
+    if (cache == NULL || owner == LC_CACHE_NOOWNER) {
         return(-1);
     }
-    if (node->did == cache->head->did && node->sec == cache->head->sec && 
-        node->blk == cache->head->blk) {
-        return(0);
+    for (int i = 0; i < cache->nshards; i++) {
+        linkedList* c = &cache->shards[i];
+        pthread_mutex_lock(&c->lock);
+        cacheRemoveOwner(c, owner);
+        pthread_mutex_unlock(&c->lock);
     }
-    if (node->next != NULL) {
-        node->next->prev = node->prev;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cache_stats
+// Description  : Get the cache statistics, in total and per device. Safe to
+//                call at any time; each shard is read under its lock.
+//
+// Inputs       : stats - the place to put the statistics
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_cache_stats( LcCacheStats *stats ) {
+    if (cache == NULL || stats == NULL) {
+        return(-1);
     }
-    if (node->prev != NULL) {
-        node->prev->next = node->next;
+    memset(stats, 0, sizeof(LcCacheStats));
+    for (int i = 0; i < cache->nshards; i++) {
+        linkedList* c = &cache->shards[i];
+        pthread_mutex_lock(&c->lock);
+        cacheAddCounters(&stats->total, &c->total);
+        for (int d = 0; d < LC_CACHE_MAXDEVICES; d++) {
+            cacheAddCounters(&stats->device[d], &c->device[d]);
+        }
+        pthread_mutex_unlock(&c->lock);
     }
+    pthread_mutex_lock(&cache->sampler.lock);
+    stats->total.resizes = cache->sampler.resizes;
+    pthread_mutex_unlock(&cache->sampler.lock);
+    return(0);
+}
 
-    cache->head->prev = node;
-    node->next = cache->head;
-    node->prev = NULL;
-    cache->head = node;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cache_filestats
+// Description  : Get the cache statistics of one open file handle
+//
+// Inputs       : owner - the file handle
+//                counters - the place to put the statistics
+// Outputs      : 0 if successful, -1 if failure
 
+int lcloud_cache_filestats( uint32_t owner, LcCacheCounters *counters ) {
+    if (cache == NULL || counters == NULL || owner == LC_CACHE_NOOWNER) {
+        return(-1);
+    }
+    memset(counters, 0, sizeof(LcCacheCounters));
+    for (int i = 0; i < cache->nshards; i++) {
+        linkedList* c = &cache->shards[i];
+        pthread_mutex_lock(&c->lock);
+        lcOwner* o = cacheFindOwner(c, owner);
+        if (o != NULL) {
+            cacheAddCounters(counters, &o->stats);
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
     return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : CacheAddLine
-// Description  : Add a new line to the cache head
+// Function     : lcloud_cache_setwriteback
+// Description  : Set the function used to write blocks to the devices
 //
-// Inputs       : listNode* node
+// Inputs       : fn - the writeback function
 // Outputs      : 0 if successful, -1 if failure
-int cacheAddLine(listNode* node) {
-    if (cache->currentblocks == cache->maxblocks) {
-        cache->maxblocks *= 2;
+
+int lcloud_cache_setwriteback( LcCacheWriteback fn ) {
+    cacheWriteback = fn;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheStore
+// Description  : Insert or update a line
+//
+// Inputs       : did - device number of block to insert
+//                sec - sector number of block to insert
+//                blk - block number of block to insert
+//                block - the block data
+//                dirty - 1 if the block is newer than the device copy
+// Outputs      : 0 if succesfully inserted, -1 if failure
+
+static int cacheStore( LcDeviceId did, uint16_t sec, uint16_t blk, char *block, int dirty ) {
+    if (cache == NULL) {
+        return(-1);
     }
-    if (cache->head == NULL) {
-        node->next = NULL;
-        node->prev = NULL;
-        cache->head = node;
-        cache->tail = node;
-        cache->currentblocks ++;
+    uint64_t key = cacheKey(did, sec, blk);
+    linkedList* c = cacheShard(key);
+
+    pthread_mutex_lock(&c->lock);
+    int32_t idx = cacheFindLine(c, key);
+    if (idx != LC_CACHE_NIL) {
+        cacheHitLine(c, idx);
+        memcpy(&c->lines[idx].block[0], &block[0], 256);
+        c->lines[idx].dirty |= (uint8_t)dirty;
+        if (dirty && c->lines[idx].owner != cacheOwner) {
+            cacheChargeLine(c, idx, cacheOwner);
+        }
+        pthread_mutex_unlock(&c->lock);
         return(0);
     }
-    if (cache->tail == cache->head) {
-        cache->head->prev = node;
-        cache->head = node;
-        node->next = cache->tail;
-        cache->tail->prev = node;
-        cache->currentblocks ++;
-        return(0);
+
+    // Copies in the lower tiers are now stale
+    int32_t zidx = zFind(&c->ztier, key);
+    if (zidx != LC_CACHE_NIL) {
+        zRemove(c, zidx);
+    }
+    int32_t slot = l2Find(&c->l2, key);
+    if (slot != LC_CACHE_NIL) {
+        l2Remove(c, slot);
+    }
+    idx = cacheInsertLine(c, key, did, sec, blk, block, dirty);
+    pthread_mutex_unlock(&c->lock);
+    return((idx == LC_CACHE_NIL) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheInsertLine
+// Description  : Add a line for a key that is not resident (shard locked)
+//
+// Inputs       : c - the cache
+//                key - the packed block address
+//                did, sec, blk - the block address
+//                block - the block data
+//                dirty - 1 if the block is newer than the device copy
+// Outputs      : the line, LC_CACHE_NIL if none could be had
+
+static int32_t cacheInsertLine(linkedList* c, uint64_t key, LcDeviceId did, uint16_t sec,
+    uint16_t blk, const char *block, int dirty) {
+
+    // A file over its share of a full shard gives up its own coldest line
+    if (cache->filequota > 0 && c->freelist == LC_CACHE_NIL) {
+        int32_t victim = cacheQuotaVictim(c, cacheOwner);
+        if (victim != LC_CACHE_NIL && cacheEvictLine(c, victim) != LC_CACHE_NIL) {
+            c->lines[victim].next = c->freelist;
+            c->freelist = victim;
+        }
+    }
+
+    // Let the policy pick (and place) the line, evicting if full
+    int32_t idx = cache->policy->miss(c, key);
+    if (idx == LC_CACHE_NIL) {
+        return(LC_CACHE_NIL);
+    }
+    listNode* node = &c->lines[idx];
+    node->key = key;
+    node->did = did;
+    node->sec = sec;
+    node->blk = blk;
+    node->dirty = (uint8_t)dirty;
+    node->owner = cacheOwner;
+    if (node->owner != LC_CACHE_NOOWNER && ownerPush(c, idx) != 0) {
+        node->owner = LC_CACHE_NOOWNER;
+    }
+    memcpy(&node->block[0], &block[0], 256);
+    uint32_t b = cacheBucket(key, c->nbuckets);
+    node->hnext = c->buckets[b];
+    c->buckets[b] = idx;
+    c->currentblocks ++;
+    cacheCount(c, did, node->owner, LC_STAT_INSERTIONS);
+    cacheCountLines(c, did, node->owner, 1);
+    return(idx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cachePromote
+// Description  : On a miss, look for the block in the compressed tier, then
+//                the local disk cache, and bring it back to a line (shard
+//                locked). The hit or miss is counted here.
+//
+// Inputs       : c - the cache
+//                key - the packed block address
+//                did, sec, blk - the block address
+//                block - place to put the block data if found
+//                idx - place to put the new line (LC_CACHE_NIL if no line
+//                      could be had; the data is still in block)
+// Outputs      : 1 if found in a lower tier, 0 if not
+
+static int cachePromote(linkedList* c, uint64_t key, LcDeviceId did, uint16_t sec, uint16_t blk,
+    char *block, int32_t *idx) {
+    lcZTier* z = &c->ztier;
+    int32_t zidx = zFind(z, key);
+
+    *idx = LC_CACHE_NIL;
+    if (zidx == LC_CACHE_NIL) {
+        // The disk copy stays, marked referenced, for when the line is
+        // evicted again
+        int32_t slot = l2Find(&c->l2, key);
+        if (slot == LC_CACHE_NIL) {
+            cacheCount(c, did, cacheOwner, LC_STAT_MISSES);
+            return(0);
+        }
+        memcpy(block, &c->l2.data[(size_t)slot * LC_DEVICE_BLOCK_SIZE], LC_DEVICE_BLOCK_SIZE);
+        c->l2.slots[slot].ref = 1;
+        cacheCount(c, did, cacheOwner, LC_STAT_HITS);
+        cacheCount(c, did, cacheOwner, LC_STAT_L2HITS);
+        *idx = cacheInsertLine(c, key, did, sec, blk, block, 0);
+        return(1);
+    }
+    zEntry* e = (zEntry *)&z->ring[z->nodes[zidx].off];
+    zDecompress((uint8_t *)&e[1], e->len, block);
+    zRemove(c, zidx);
+    cacheCount(c, did, cacheOwner, LC_STAT_HITS);
+    cacheCount(c, did, cacheOwner, LC_STAT_ZHITS);
+    *idx = cacheInsertLine(c, key, did, sec, blk, block, 0);
+    return(1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_initcache
+// Description  : Initialze the cache by setting up metadata a cache elements.
+//                The policy can be overridden with LCLOUD_CACHE_POLICY.
+//
+// Inputs       : maxblocks - the max number number of blocks
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_initcache( int maxblocks ) {
+    LcCacheConfig cfg;
+    if (lcloud_cacheconfig(&cfg, maxblocks) != 0) {
+        return(-1);
+    }
+    return(lcloud_initcache_config(&cfg));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_initcache_sharded
+// Description  : Initialze the cache with an explicit number of shards
+//
+// Inputs       : maxblocks - the max number number of blocks
+//                nshards - number of shards (power of 2, at most
+//                          LC_CACHE_MAXSHARDS)
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_initcache_sharded( int maxblocks, int nshards ) {
+    LcCacheConfig cfg;
+    if (lcloud_cacheconfig(&cfg, maxblocks) != 0) {
+        return(-1);
+    }
+    cfg.nshards = nshards;
+    return(lcloud_initcache_config(&cfg));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cacheconfig
+// Description  : Fill in the default cache configuration, then apply any
+//                overrides from the environment
+//
+// Inputs       : cfg - the configuration to fill in
+//                maxblocks - the max number number of blocks
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_cacheconfig( LcCacheConfig *cfg, int maxblocks ) {
+    const char *env;
+
+    cfg->maxblocks = (maxblocks > 0) ? maxblocks : LC_CACHE_MAXBLOCKS;
+    cfg->nshards = 0;
+    cfg->policy = LC_CACHE_LRU;
+    cfg->writeback = 0;
+    cfg->snapshot = NULL;
+    cfg->stamp = 0;
+    cfg->zblocks = 0;
+    cfg->l2file = NULL;
+    cfg->l2blocks = 0;
+    cfg->filequota = 0;
+    cfg->targetmiss = 0.0;
+    cfg->minblocks = 0;
+    cfg->limitblocks = 0;
+
+    if ((env = getenv(LC_CACHE_POLICY_ENV)) != NULL && *env != '\0') {
+        cfg->policy = lcloud_cachepolicy(env);
+        if (cfg->policy == LC_CACHE_MAXPOLICY) {
+            logMessage(LOG_ERROR_LEVEL, "Unknown cache policy [%s=%s]", LC_CACHE_POLICY_ENV, env);
+            return(-1);
+        }
+    }
+    if ((env = getenv(LC_CACHE_WRITEBACK_ENV)) != NULL && *env != '\0') {
+        cfg->writeback = (atoi(env) != 0);
+    }
+    if ((env = getenv(LC_CACHE_SNAPSHOT_ENV)) != NULL && *env != '\0') {
+        cfg->snapshot = env;
+    }
+    if ((env = getenv(LC_CACHE_STAMP_ENV)) != NULL && *env != '\0') {
+        cfg->stamp = strtoull(env, NULL, 0);
+    }
+    if ((env = getenv(LC_CACHE_ZBLOCKS_ENV)) != NULL && *env != '\0') {
+        cfg->zblocks = CMPSC311_MAXVAL(atoi(env), 0);
+    }
+    if ((env = getenv(LC_CACHE_L2FILE_ENV)) != NULL && *env != '\0') {
+        cfg->l2file = env;
+    }
+    if ((env = getenv(LC_CACHE_L2BLOCKS_ENV)) != NULL && *env != '\0') {
+        cfg->l2blocks = CMPSC311_MAXVAL(atoi(env), 0);
+    }
+    if ((env = getenv(LC_CACHE_FILEQUOTA_ENV)) != NULL && *env != '\0') {
+        cfg->filequota = CMPSC311_MINVAL(CMPSC311_MAXVAL(atoi(env), 0), 100);
+    }
+    if ((env = getenv(LC_CACHE_TARGETMISS_ENV)) != NULL && *env != '\0') {
+        cfg->targetmiss = atof(env);
+    }
+    if ((env = getenv(LC_CACHE_MINBLOCKS_ENV)) != NULL && *env != '\0') {
+        cfg->minblocks = CMPSC311_MAXVAL(atoi(env), 0);
+    }
+    if ((env = getenv(LC_CACHE_MAXBLOCKS_ENV)) != NULL && *env != '\0') {
+        cfg->limitblocks = CMPSC311_MAXVAL(atoi(env), 0);
     }
-    cache->head->prev = node;
-    node->next = cache->head;
-    cache->head = node;
-    node->prev = NULL;
-    cache->currentblocks ++;
     return(0);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachepolicy
+// Description  : Look up a replacement policy by name
+//
+// Inputs       : name - the policy name ("lru", "2q", "arc", "lfu")
+// Outputs      : the policy, LC_CACHE_MAXPOLICY if unknown
+
+LcCachePolicyType lcloud_cachepolicy( const char *name ) {
+    for (int i = 0; i < LC_CACHE_MAXPOLICY; i++) {
+        if (strcasecmp(name, LC_CACHE_POLICY_LABELS[i]) == 0) {
+            return((LcCachePolicyType)i);
+        }
+    }
+    return(LC_CACHE_MAXPOLICY);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_initcache_config
+// Description  : Initialze the cache from a configuration
+//
+// Inputs       : cfg - the cache configuration (nshards 0 picks a count so
+//                      each shard has at least LC_CACHE_MINSHARDBLOCKS)
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_initcache_config( const LcCacheConfig *cfg ) {
+    int maxblocks = cfg->maxblocks, nshards = cfg->nshards, shardbits = 0;
+    if (cache != NULL) {
+        lcloud_closecache();
+    }
+    if (maxblocks <= 0) {
+        maxblocks = LC_CACHE_MAXBLOCKS;
+    }
+    if (cfg->policy < 0 || cfg->policy >= LC_CACHE_MAXPOLICY) {
+        logMessage(LOG_ERROR_LEVEL, "Bad cache policy [%d]", cfg->policy);
+        return(-1);
+    }
+    if (nshards == 0) {
+        nshards = 1;
+        while (nshards * 2 <= LC_CACHE_MAXSHARDS &&
+               maxblocks / (nshards * 2) >= LC_CACHE_MINSHARDBLOCKS) {
+            nshards *= 2;
+        }
+    }
+    if (nshards < 0 || nshards > LC_CACHE_MAXSHARDS || (nshards & (nshards - 1)) ||
+        nshards > maxblocks) {
+        logMessage(LOG_ERROR_LEVEL, "Bad number of cache shards [%d]", nshards);
+        return(-1);
+    }
+    while ((1 << shardbits) < nshards) {
+        shardbits++;
+    }
+
+    cache = malloc(sizeof(lcCache));
+    if (cache == NULL) {
+        return(-1);
+    }
+    cache->shards = calloc(nshards, sizeof(linkedList));
+    if (cache->shards == NULL) {
+        free(cache);
+        cache = NULL;
+        return(-1);
+    }
+    cache->nshards = nshards;
+    cache->shardbits = shardbits;
+    cache->maxblocks = maxblocks;
+    cache->writeback = cfg->writeback;
+    cache->filequota = CMPSC311_MINVAL(CMPSC311_MAXVAL(cfg->filequota, 0), 100);
+    cache->type = cfg->policy;
+    cache->policy = lcCachePolicies[cfg->policy];
+    cache->snapshot = (cfg->snapshot != NULL) ? strdup(cfg->snapshot) : NULL;
+    cache->stamp = cfg->stamp;
+    cache->l2map = NULL;
+    cache->l2size = 0;
+    if (sampleInit(&cache->sampler, cfg, maxblocks, nshards) != 0) {
+        free(cache->snapshot);
+        free(cache->shards);
+        free(cache);
+        cache = NULL;
+        return(-1);
+    }
+
+    // Split the capacity over the shards; adaptive sizing reserves (but
+    // does not touch) slab space up to its upper bound
+    int limit = CMPSC311_MAXVAL(maxblocks, cache->sampler.limitblocks);
+    for (int i = 0; i < nshards; i++) {
+        int blocks = maxblocks / nshards + (i < maxblocks % nshards);
+        int slab = limit / nshards + (i < limit % nshards);
+        uint32_t zbytes = (uint32_t)((uint64_t)CMPSC311_MAXVAL(cfg->zblocks, 0) *
+            LC_DEVICE_BLOCK_SIZE / nshards);
+        if (cacheInitShard(&cache->shards[i], blocks, slab, cache->policy->ghosts, zbytes) != 0) {
+            cache->nshards = i;
+            return(cacheAbortInit());
+        }
+    }
+
+    // Map the local disk cache and split it over the shards
+    if (cfg->l2file != NULL && cfg->l2blocks > 0) {
+        if (cfg->l2blocks < nshards || l2Open(cfg->l2file, cfg->l2blocks) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "Cache: local disk cache [%s] not opened", cfg->l2file);
+            return(cacheAbortInit());
+        }
+        size_t off = 0;
+        for (int i = 0; i < nshards; i++) {
+            int slots = cfg->l2blocks / nshards + (i < cfg->l2blocks % nshards);
+            if (l2Init(&cache->shards[i].l2, &cache->l2map[off], slots) != 0) {
+                return(cacheAbortInit());
+            }
+            off += (size_t)slots * LC_DEVICE_BLOCK_SIZE;
+        }
+    }
+
+    // Warm start from the last snapshot; a missing or stale one is skipped
+    if (cache->snapshot != NULL) {
+        cacheLoadSnapshot(cache->snapshot, cache->stamp);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheAbortInit
+// Description  : Tear down a cache whose initialization failed part way,
+//                without saving over the snapshot it never loaded
+//
+// Inputs       : none
+// Outputs      : -1 always
+
+int cacheAbortInit(void) {
+    free(cache->snapshot);
+    cache->snapshot = NULL;
+    lcloud_closecache();
+    return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_closecache
+// Description  : Clean up the cache when program is closing
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_closecache( void ) {
+    int ret = 0;
+    if (cache == NULL) {
+        return(-1);
+    }
+    if (lcloud_flushcache() != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Cache flush failed at close, dirty blocks lost");
+        ret = -1;
+    } else if (cache->snapshot != NULL && cacheSaveSnapshot(cache->snapshot, cache->stamp) != 0) {
+        ret = -1;
+    }
+    for (int i = 0; i < cache->nshards; i++) {
+        cacheFreeShard(&cache->shards[i]);
+    }
+    sampleFree(&cache->sampler);
+    if (cache->l2map != NULL) {
+        munmap(cache->l2map, cache->l2size);
+    }
+    free(cache->snapshot);
+    free(cache->shards);
+    free(cache);
+    cache = NULL;
+    return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheSaveSnapshot
+// Description  : Save the resident lines to a snapshot file. Each shard's
+//                lines are written oldest first, list by list, so reloading
+//                them in file order restores the recency order. The file
+//                is written under a temporary name and renamed into place.
+//
+// Inputs       : path - the snapshot file
+//                stamp - the device state the lines belong to
+// Outputs      : 0 if successful, -1 if failure
+
+int cacheSaveSnapshot(const char* path, uint64_t stamp) {
+    lcSnapshotHeader hdr;
+    lcSnapshotLine rec;
+    char tmp[strlen(path) + 5];
+    FILE* fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fp = fopen(tmp, "wb")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Cannot write cache snapshot [%s]", tmp);
+        return(-1);
+    }
+
+    // The header is rewritten once the count and checksum are known
+    memset(&hdr, 0, sizeof(hdr));
+    memset(&rec, 0, sizeof(rec));
+    hdr.magic = LC_CACHE_SNAPSHOT_MAGIC;
+    hdr.version = LC_CACHE_SNAPSHOT_VERSION;
+    hdr.blocksize = LC_DEVICE_BLOCK_SIZE;
+    hdr.stamp = stamp;
+    hdr.checksum = LC_CACHE_FNV_OFFSET;
+    int ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+    for (int i = 0; i < cache->nshards && ok; i++) {
+        linkedList* c = &cache->shards[i];
+        pthread_mutex_lock(&c->lock);
+        for (int l = 0; l < LC_CACHE_MAXLISTS && ok; l++) {
+            for (int32_t idx = c->lists[l].tail; idx != LC_CACHE_NIL && ok; idx = c->lines[idx].prev) {
+                rec.did = c->lines[idx].did;
+                rec.sec = c->lines[idx].sec;
+                rec.blk = c->lines[idx].blk;
+                memcpy(rec.block, c->lines[idx].block, LC_DEVICE_BLOCK_SIZE);
+                for (size_t b = 0; b < sizeof(rec); b++) {
+                    hdr.checksum = (hdr.checksum ^ ((uint8_t *)&rec)[b]) * LC_CACHE_FNV_PRIME;
+                }
+                ok = (fwrite(&rec, sizeof(rec), 1, fp) == 1);
+                hdr.nlines ++;
+            }
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp, path) != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Cache snapshot save failed [%s]", path);
+        unlink(tmp);
+        return(-1);
+    }
+    logMessage(LOG_INFO_LEVEL, "Saved %u cache lines to snapshot [%s]", hdr.nlines, path);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheLoadSnapshot
+// Description  : Map a snapshot file and insert its lines, oldest first. The
+//                snapshot is ignored unless its format, block size, stamp
+//                and checksum all match.
+//
+// Inputs       : path - the snapshot file
+//                stamp - the device state the lines must belong to
+// Outputs      : number of lines loaded, -1 if no usable snapshot
+
+int cacheLoadSnapshot(const char* path, uint64_t stamp) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return(-1);
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(lcSnapshotHeader)) {
+        close(fd);
+        return(-1);
+    }
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return(-1);
+    }
+
+    // Validate the stamp and the contents before trusting any line
+    lcSnapshotHeader* hdr = (lcSnapshotHeader *)map;
+    const lcSnapshotLine* recs = (const lcSnapshotLine *)&map[sizeof(lcSnapshotHeader)];
+    uint64_t checksum = LC_CACHE_FNV_OFFSET;
+    int loaded = -1;
+    if (hdr->magic != LC_CACHE_SNAPSHOT_MAGIC || hdr->version != LC_CACHE_SNAPSHOT_VERSION ||
+        hdr->blocksize != LC_DEVICE_BLOCK_SIZE ||
+        st.st_size != (off_t)(sizeof(lcSnapshotHeader) + (size_t)hdr->nlines * sizeof(lcSnapshotLine))) {
+        logMessage(LOG_WARNING_LEVEL, "Ignoring malformed cache snapshot [%s]", path);
+    } else if (hdr->stamp != stamp) {
+        logMessage(LOG_WARNING_LEVEL, "Ignoring stale cache snapshot [%s]", path);
+    } else {
+        for (size_t b = 0; b < (size_t)hdr->nlines * sizeof(lcSnapshotLine); b++) {
+            checksum = (checksum ^ (uint8_t)map[sizeof(lcSnapshotHeader) + b]) * LC_CACHE_FNV_PRIME;
+        }
+        if (checksum != hdr->checksum) {
+            logMessage(LOG_WARNING_LEVEL, "Ignoring corrupt cache snapshot [%s]", path);
+        } else {
+            for (loaded = 0; loaded < (int)hdr->nlines; loaded++) {
+                cacheStore(recs[loaded].did, recs[loaded].sec, recs[loaded].blk,
+                    (char *)recs[loaded].block, 0);
+            }
+            logMessage(LOG_INFO_LEVEL, "Loaded %d cache lines from snapshot [%s]", loaded, path);
+        }
+    }
+    munmap(map, st.st_size);
+    return(loaded);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheInitShard
+// Description  : Allocate the line slab, index and ghosts of one shard
+//
+// Inputs       : c - the shard
+//                maxblocks - the number of lines in the shard
+//                slabblocks - the most lines the shard can grow to
+//                ghosts - ghost capacity as a multiple of slabblocks
+// Outputs      : 0 if successful, -1 if failure
+
+int cacheInitShard(linkedList* c, int maxblocks, int slabblocks, int ghosts, uint32_t zbytes) {
+
+    // Size the index for a load factor of at most 1/2
+    slabblocks = CMPSC311_MAXVAL(slabblocks, maxblocks);
+    uint32_t nbuckets = LC_CACHE_MINBUCKETS;
+    while (nbuckets < (uint32_t)slabblocks * 2) {
+        nbuckets <<= 1;
+    }
+
+    // Allocate the line slab and the index up front; the slab is mapped so
+    // lines above the capacity cost no memory until the shard grows
+    memset(c, 0, sizeof(linkedList));
+    c->lines = mmap(NULL, sizeof(listNode) * slabblocks, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    c->buckets = malloc(sizeof(int32_t) * nbuckets);
+    if (c->lines == MAP_FAILED || c->buckets == NULL) {
+        if (c->lines != MAP_FAILED) {
+            munmap(c->lines, sizeof(listNode) * slabblocks);
+        }
+        free(c->buckets);
+        return(-1);
+    }
+    c->nbuckets = nbuckets;
+    c->maxblocks = maxblocks;
+    c->slabblocks = slabblocks;
+    c->total.capacity = maxblocks;
+    for (uint32_t i = 0; i < nbuckets; i++) {
+        c->buckets[i] = LC_CACHE_NIL;
+    }
+    for (int i = 0; i < LC_CACHE_MAXLISTS; i++) {
+        c->lists[i].head = c->lists[i].tail = LC_CACHE_NIL;
+    }
+    c->freeowners = LC_CACHE_NIL;
+
+    // Chain every line onto the free list
+    for (int i = 0; i < maxblocks; i++) {
+        c->lines[i].next = (i + 1 < maxblocks) ? i + 1 : LC_CACHE_NIL;
+        c->lines[i].dirty = 0;
+        c->lines[i].pins = 0;
+    }
+    c->freelist = 0;
+
+    // The ghost lists get their own slab and index
+    lcGhosts* g = &c->ghosts;
+    g->freelist = LC_CACHE_NIL;
+    g->lists[0].head = g->lists[0].tail = LC_CACHE_NIL;
+    g->lists[1].head = g->lists[1].tail = LC_CACHE_NIL;
+    if (ghosts > 0) {
+        g->capacity = slabblocks * ghosts;
+        g->nbuckets = LC_CACHE_MINBUCKETS;
+        while (g->nbuckets < (uint32_t)g->capacity * 2) {
+            g->nbuckets <<= 1;
+        }
+        g->nodes = malloc(sizeof(ghostNode) * g->capacity);
+        g->buckets = malloc(sizeof(int32_t) * g->nbuckets);
+        if (g->nodes == NULL || g->buckets == NULL) {
+            free(g->nodes);
+            free(g->buckets);
+            munmap(c->lines, sizeof(listNode) * slabblocks);
+            free(c->buckets);
+            return(-1);
+        }
+        for (uint32_t i = 0; i < g->nbuckets; i++) {
+            g->buckets[i] = LC_CACHE_NIL;
+        }
+        for (int i = 0; i < g->capacity; i++) {
+            g->nodes[i].next = (i + 1 < g->capacity) ? i + 1 : LC_CACHE_NIL;
+        }
+        g->freelist = 0;
+    }
+
+    // The compressed tier, if any, also has its own ring and index
+    if (zInit(&c->ztier, zbytes) != 0) {
+        free(g->nodes);
+        free(g->buckets);
+        munmap(c->lines, sizeof(listNode) * slabblocks);
+        free(c->buckets);
+        return(-1);
+    }
+
+    pthread_mutex_init(&c->lock, NULL);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheFreeShard
+// Description  : Release the memory of one shard
+//
+// Inputs       : c - the shard
+// Outputs      : none
+
+void cacheFreeShard(linkedList* c) {
+    pthread_mutex_destroy(&c->lock);
+    if (c->lines != NULL) {
+        munmap(c->lines, sizeof(listNode) * c->slabblocks);
+    }
+    free(c->buckets);
+    free(c->ghosts.nodes);
+    free(c->ghosts.buckets);
+    free(c->owners);
+    free(c->ownerbuckets);
+    free(c->ownerheap);
+    free(c->ztier.ring);
+    free(c->ztier.nodes);
+    free(c->ztier.buckets);
+    memset(&c->ztier, 0, sizeof(lcZTier));
+    free(c->l2.slots);
+    free(c->l2.buckets);
+    memset(&c->l2, 0, sizeof(lcL2));
+    c->owners = NULL;
+    c->ownerbuckets = NULL;
+    c->ownerheap = NULL;
+    c->nowners = 0;
+    c->nheap = 0;
+    c->lines = NULL;
+    c->buckets = NULL;
+    c->ghosts.nodes = NULL;
+    c->ghosts.buckets = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheResize
+// Description  : Change the capacity of the cache, split over the shards
+//
+// Inputs       : maxblocks - the new capacity
+// Outputs      : none
+
+void cacheResize(int maxblocks) {
+    for (int i = 0; i < cache->nshards; i++) {
+        linkedList* c = &cache->shards[i];
+        int blocks = maxblocks / cache->nshards + (i < maxblocks % cache->nshards);
+        pthread_mutex_lock(&c->lock);
+        cacheResizeShard(c, blocks);
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheResizeShard
+// Description  : Change the capacity of a shard (shard locked). Growing
+//                frees more of the slab; shrinking evicts down to the new
+//                capacity (coldest list first), moves the lines left above
+//                it down, and gives the slab pages above it back. Pinned
+//                lines cannot move, so they can hold the capacity up.
+//
+// Inputs       : c - the shard
+//                maxblocks - the new capacity
+// Outputs      : 0 if successful, -1 if failure
+
+int cacheResizeShard(linkedList* c, int maxblocks) {
+    maxblocks = CMPSC311_MINVAL(CMPSC311_MAXVAL(maxblocks, 1), c->slabblocks);
+    if (maxblocks == c->maxblocks) {
+        return(0);
+    }
+
+    // Growing: the new lines go on the free list
+    if (maxblocks > c->maxblocks) {
+        for (int32_t idx = c->maxblocks; idx < maxblocks; idx++) {
+            c->lines[idx].dirty = 0;
+            c->lines[idx].pins = 0;
+            c->lines[idx].next = c->freelist;
+            c->freelist = idx;
+        }
+        c->maxblocks = maxblocks;
+        c->total.capacity = maxblocks;
+        return(0);
+    }
+
+    // Shrinking: evict down to the new capacity
+    while (c->currentblocks > maxblocks) {
+        int32_t victim = LC_CACHE_NIL;
+        for (int l = 0; l < LC_CACHE_MAXLISTS && victim == LC_CACHE_NIL; l++) {
+            victim = cacheVictim(c, l);
+        }
+        if (victim == LC_CACHE_NIL || cacheEvictLine(c, victim) == LC_CACHE_NIL) {
+            break;
+        }
+        c->lines[victim].next = c->freelist;
+        c->freelist = victim;
+    }
+
+    // Find the resident lines; pinned ones above the capacity stay put
+    uint8_t* resident = calloc(c->maxblocks, sizeof(uint8_t));
+    if (resident == NULL) {
+        return(-1);
+    }
+    for (int l = 0; l < LC_CACHE_MAXLISTS; l++) {
+        for (int32_t idx = c->lists[l].head; idx != LC_CACHE_NIL; idx = c->lines[idx].next) {
+            resident[idx] = 1;
+        }
+    }
+    maxblocks = CMPSC311_MAXVAL(maxblocks, c->currentblocks);
+    for (int32_t idx = maxblocks; idx < c->maxblocks; idx++) {
+        if (resident[idx] && c->lines[idx].pins > 0) {
+            maxblocks = idx + 1;
+        }
+    }
+
+    // Move the lines above the capacity into free lines below it
+    int32_t freelist = LC_CACHE_NIL;
+    for (int32_t idx = maxblocks - 1; idx >= 0; idx--) {
+        if (!resident[idx]) {
+            c->lines[idx].next = freelist;
+            freelist = idx;
+        }
+    }
+    for (int32_t idx = maxblocks; idx < c->maxblocks; idx++) {
+        if (resident[idx]) {
+            int32_t to = freelist;
+            freelist = c->lines[to].next;
+            cacheMoveLine(c, idx, to);
+        }
+    }
+    free(resident);
+    c->freelist = freelist;
+    c->maxblocks = maxblocks;
+    c->total.capacity = maxblocks;
+    c->arcp = CMPSC311_MINVAL(c->arcp, maxblocks);
+
+    // Give the whole pages above the capacity back
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)&c->lines[maxblocks], end = (uintptr_t)&c->lines[c->slabblocks];
+    start = (start + page - 1) & ~(uintptr_t)(page - 1);
+    if (start < end) {
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheMoveLine
+// Description  : Move a resident line to a free line (shard locked)
+//
+// Inputs       : c - the shard
+//                from - the resident line
+//                to - the free line
+// Outputs      : none
+
+void cacheMoveLine(linkedList* c, int32_t from, int32_t to) {
+    listNode* node = &c->lines[to];
+    lcList* l;
+
+    memcpy(node, &c->lines[from], sizeof(listNode));
+    l = &c->lists[node->list];
+    if (node->prev != LC_CACHE_NIL) {
+        c->lines[node->prev].next = to;
+    } else {
+        l->head = to;
+    }
+    if (node->next != LC_CACHE_NIL) {
+        c->lines[node->next].prev = to;
+    } else {
+        l->tail = to;
+    }
+    int32_t* link = &c->buckets[cacheBucket(node->key, c->nbuckets)];
+    while (*link != from) {
+        link = &c->lines[*link].hnext;
+    }
+    *link = to;
+    if (node->owner != LC_CACHE_NOOWNER) {
+        lcList* o = &cacheFindOwner(c, node->owner)->lines;
+        if (node->oprev != LC_CACHE_NIL) {
+            c->lines[node->oprev].onext = to;
+        } else {
+            o->head = to;
+        }
+        if (node->onext != LC_CACHE_NIL) {
+            c->lines[node->onext].oprev = to;
+        } else {
+            o->tail = to;
+        }
+    }
+    c->lines[from].dirty = 0;
+    c->lines[from].pins = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheFindOwner
+// Description  : Find an owner in the shard's owner table
+//
+// Inputs       : c - the cache
+//                owner - the file handle
+// Outputs      : the owner, NULL if it is not tracked
+
+lcOwner* cacheFindOwner(linkedList* c, uint32_t owner) {
+    if (owner == LC_CACHE_NOOWNER || c->nowners == 0) {
+        return(NULL);
+    }
+    int32_t i = c->ownerbuckets[cacheBucket(owner, c->nowners)];
+    while (i != LC_CACHE_NIL && c->owners[i].key != owner) {
+        i = c->owners[i].hnext;
+    }
+    return((i == LC_CACHE_NIL) ? NULL : &c->owners[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheAddOwner
+// Description  : Add an owner to the shard's owner table, doubling the
+//                table (up to LC_CACHE_MAXOWNERS) when it is full
+//
+// Inputs       : c - the cache
+//                owner - the file handle
+// Outputs      : 0 if successful, -1 if the table is full or out of memory
+
+int cacheAddOwner(linkedList* c, uint32_t owner) {
+    if (cacheFindOwner(c, owner) != NULL) {
+        return(0);
+    }
+    if (c->freeowners == LC_CACHE_NIL) {
+        uint32_t n = (c->nowners == 0) ? LC_CACHE_MINOWNERS : c->nowners * 2;
+        if (n > LC_CACHE_MAXOWNERS) {
+            return(-1);
+        }
+        lcOwner* owners = realloc(c->owners, n * sizeof(lcOwner));
+        if (owners == NULL) {
+            return(-1);
+        }
+        c->owners = owners;
+        int32_t* heap = realloc(c->ownerheap, n * sizeof(int32_t));
+        if (heap == NULL) {
+            return(-1);
+        }
+        c->ownerheap = heap;
+        int32_t* buckets = malloc(n * sizeof(int32_t));
+        if (buckets == NULL) {
+            return(-1);
+        }
+
+        // The new records are free; the old ones are all in use and rehashed
+        for (uint32_t i = 0; i < n; i++) {
+            buckets[i] = LC_CACHE_NIL;
+        }
+        for (uint32_t i = 0; i < c->nowners; i++) {
+            uint32_t b = cacheBucket(owners[i].key, n);
+            owners[i].hnext = buckets[b];
+            buckets[b] = i;
+        }
+        for (uint32_t i = c->nowners; i < n; i++) {
+            owners[i].key = LC_CACHE_NOOWNER;
+            owners[i].hnext = (i + 1 < n) ? (int32_t)(i + 1) : LC_CACHE_NIL;
+        }
+        c->freeowners = c->nowners;
+        free(c->ownerbuckets);
+        c->ownerbuckets = buckets;
+        c->nowners = n;
+    }
+
+    int32_t i = c->freeowners;
+    lcOwner* o = &c->owners[i];
+    c->freeowners = o->hnext;
+    memset(o, 0, sizeof(lcOwner));
+    o->key = owner;
+    o->lines.head = o->lines.tail = LC_CACHE_NIL;
+    uint32_t b = cacheBucket(owner, c->nowners);
+    o->hnext = c->ownerbuckets[b];
+    c->ownerbuckets[b] = i;
+    o->heappos = c->nheap;
+    c->ownerheap[c->nheap++] = i;
+    ownerHeapUp(c, o->heappos);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheRemoveOwner
+// Description  : Take an owner out of the shard's owner table; its lines
+//                stay resident, charged to no one
+//
+// Inputs       : c - the cache
+//                owner - the file handle
+// Outputs      : none
+
+void cacheRemoveOwner(linkedList* c, uint32_t owner) {
+    lcOwner* o = cacheFindOwner(c, owner);
+    if (o == NULL) {
+        return;
+    }
+    int32_t idx = o->lines.head;
+    while (idx != LC_CACHE_NIL) {
+        int32_t next = c->lines[idx].onext;
+        c->lines[idx].owner = LC_CACHE_NOOWNER;
+        c->lines[idx].oprev = c->lines[idx].onext = LC_CACHE_NIL;
+        idx = next;
+    }
+    if (o->stats.lines > 0) {
+        c->activeowners --;
+    }
+
+    // Fill its place in the heap with the last owner
+    uint32_t pos = o->heappos;
+    c->nheap --;
+    if (pos < c->nheap) {
+        c->ownerheap[pos] = c->ownerheap[c->nheap];
+        c->owners[c->ownerheap[pos]].heappos = pos;
+        ownerHeapUp(c, pos);
+        ownerHeapDown(c, c->owners[c->ownerheap[pos]].heappos);
+    }
+
+    int32_t i = (int32_t)(o - c->owners);
+    int32_t* link = &c->ownerbuckets[cacheBucket(owner, c->nowners)];
+    while (*link != i) {
+        link = &c->owners[*link].hnext;
+    }
+    *link = o->hnext;
+    o->key = LC_CACHE_NOOWNER;
+    o->hnext = c->freeowners;
+    c->freeowners = i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheChargeLine
+// Description  : Move a line to another owner (a dirty line goes to the
+//                handle that wrote it, so closing that handle flushes it)
+//
+// Inputs       : c - the cache
+//                idx - the line
+//                owner - the file handle to charge
+// Outputs      : none
+
+void cacheChargeLine(linkedList* c, int32_t idx, uint32_t owner) {
+    listNode* node = &c->lines[idx];
+    if (node->owner != LC_CACHE_NOOWNER) {
+        ownerUnlink(c, idx);
+    }
+    cacheCountLines(c, node->did, node->owner, -1);
+    node->owner = owner;
+    if (node->owner != LC_CACHE_NOOWNER && ownerPush(c, idx) != 0) {
+        node->owner = LC_CACHE_NOOWNER;
+    }
+    cacheCountLines(c, node->did, node->owner, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheHitLine
+// Description  : A resident line was referenced: tell the policy and, with
+//                file quotas on, make it its owner's most recent line
+//
+// Inputs       : c - the cache
+//                idx - the line
+// Outputs      : none
+
+void cacheHitLine(linkedList* c, int32_t idx) {
+    cache->policy->hit(c, idx);
+    if (cache->filequota > 0 && c->lines[idx].owner != LC_CACHE_NOOWNER) {
+        ownerUnlink(c, idx);
+        ownerPush(c, idx);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheQuotaVictim
+// Description  : Pick the line to give up before inserting into a full
+//                shard. An owner's share is the larger of the quota and an
+//                even split among the files holding lines, so one file alone
+//                may still fill the cache. An inserting file over its share
+//                gives up its own coldest line; otherwise the file furthest
+//                over its share (the top of the owner heap) does.
+//
+// Inputs       : c - the cache
+//                owner - the file handle inserting
+// Outputs      : the coldest unpinned line of that file, LC_CACHE_NIL if
+//                no file is over its share (the policy decides)
+
+int32_t cacheQuotaVictim(linkedList* c, uint32_t owner) {
+    int share = CMPSC311_MAXVAL(c->maxblocks * cache->filequota / 100,
+        c->maxblocks / CMPSC311_MAXVAL(c->activeowners, 1));
+    lcOwner* inserting = cacheFindOwner(c, owner);
+    lcList* o = (inserting != NULL) ? &inserting->lines : NULL;
+
+    share = CMPSC311_MAXVAL(share, 1);
+    if (o == NULL || o->count < share) {
+        if (c->nheap == 0 || c->owners[c->ownerheap[0]].lines.count <= share) {
+            return(LC_CACHE_NIL);
+        }
+        o = &c->owners[c->ownerheap[0]].lines;
+    }
+    int32_t idx = o->tail;
+    while (idx != LC_CACHE_NIL && c->lines[idx].pins > 0) {
+        idx = c->lines[idx].oprev;
+    }
+    return(idx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ownerPush
+// Description  : Put a line at the head of its owner's list
+//
+// Inputs       : c - the cache
+//                idx - the line
+// Outputs      : 0 if successful, -1 if the owner is not tracked
+
+int ownerPush(linkedList* c, int32_t idx) {
+    listNode* node = &c->lines[idx];
+    lcOwner* owner = cacheFindOwner(c, node->owner);
+    if (owner == NULL) {
+        return(-1);
+    }
+    lcList* o = &owner->lines;
+    node->oprev = LC_CACHE_NIL;
+    node->onext = o->head;
+    if (o->head == LC_CACHE_NIL) {
+        o->tail = idx;
+    } else {
+        c->lines[o->head].oprev = idx;
+    }
+    o->head = idx;
+    o->count ++;
+    ownerHeapUp(c, owner->heappos);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ownerUnlink
+// Description  : Take a line off its owner's list
+//
+// Inputs       : c - the cache
+//                idx - the line
+// Outputs      : none
+
+void ownerUnlink(linkedList* c, int32_t idx) {
+    listNode* node = &c->lines[idx];
+    lcOwner* owner = cacheFindOwner(c, node->owner);
+    if (owner == NULL) {
+        return;
+    }
+    lcList* o = &owner->lines;
+    if (node->oprev != LC_CACHE_NIL) {
+        c->lines[node->oprev].onext = node->onext;
+    } else {
+        o->head = node->onext;
+    }
+    if (node->onext != LC_CACHE_NIL) {
+        c->lines[node->onext].oprev = node->oprev;
+    } else {
+        o->tail = node->oprev;
+    }
+    o->count --;
+    ownerHeapDown(c, owner->heappos);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ownerHeapUp
+// Description  : Move an owner up the heap after its line count grew
+//
+// Inputs       : c - the cache
+//                pos - the owner's place in the heap
+// Outputs      : none
+
+void ownerHeapUp(linkedList* c, uint32_t pos) {
+    int32_t i = c->ownerheap[pos];
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) / 2;
+        if (c->owners[c->ownerheap[parent]].lines.count >= c->owners[i].lines.count) {
+            break;
+        }
+        c->ownerheap[pos] = c->ownerheap[parent];
+        c->owners[c->ownerheap[pos]].heappos = pos;
+        pos = parent;
+    }
+    c->ownerheap[pos] = i;
+    c->owners[i].heappos = pos;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ownerHeapDown
+// Description  : Move an owner down the heap after its line count shrank
+//
+// Inputs       : c - the cache
+//                pos - the owner's place in the heap
+// Outputs      : none
+
+void ownerHeapDown(linkedList* c, uint32_t pos) {
+    int32_t i = c->ownerheap[pos];
+    for (;;) {
+        uint32_t child = pos * 2 + 1;
+        if (child >= c->nheap) {
+            break;
+        }
+        if (child + 1 < c->nheap &&
+            c->owners[c->ownerheap[child + 1]].lines.count > c->owners[c->ownerheap[child]].lines.count) {
+            child ++;
+        }
+        if (c->owners[c->ownerheap[child]].lines.count <= c->owners[i].lines.count) {
+            break;
+        }
+        c->ownerheap[pos] = c->ownerheap[child];
+        c->owners[c->ownerheap[pos]].heappos = pos;
+        pos = child;
+    }
+    c->ownerheap[pos] = i;
+    c->owners[i].heappos = pos;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheCount
+// Description  : Bump one counter for the shard, the device and the owner
+//
+// Inputs       : c - the cache
+//                did - the device of the block
+//                owner - the file handle charged
+//                field - the counter (LC_STAT_*)
+// Outputs      : none
+
+void cacheCount(linkedList* c, LcDeviceId did, uint32_t owner, int field) {
+    lcOwner* o = cacheFindOwner(c, owner);
+    (*(uint64_t *)((char *)&c->total + field)) ++;
+    if (did < LC_CACHE_MAXDEVICES) {
+        (*(uint64_t *)((char *)&c->device[did] + field)) ++;
+    }
+    if (o != NULL) {
+        (*(uint64_t *)((char *)&o->stats + field)) ++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheCountLines
+// Description  : Track the resident lines and bytes for the shard, the
+//                device and the owner
+//
+// Inputs       : c - the cache
+//                did - the device of the block
+//                owner - the file handle the line is charged to
+//                delta - +1 for an inserted line, -1 for a removed one
+// Outputs      : none
+
+void cacheCountLines(linkedList* c, LcDeviceId did, uint32_t owner, int delta) {
+    lcOwner* o = cacheFindOwner(c, owner);
+    c->total.lines += delta;
+    c->total.bytes += delta * LC_DEVICE_BLOCK_SIZE;
+    if (did < LC_CACHE_MAXDEVICES) {
+        c->device[did].lines += delta;
+        c->device[did].bytes += delta * LC_DEVICE_BLOCK_SIZE;
+    }
+    if (o != NULL) {
+        o->stats.lines += delta;
+        o->stats.bytes += delta * LC_DEVICE_BLOCK_SIZE;
+        if (o->stats.lines == (delta > 0)) {
+            c->activeowners += delta;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheAddCounters
+// Description  : Add one set of counters into another
+//
+// Inputs       : to - the counters to add to
+//                from - the counters to add
+// Outputs      : none
+
+static void cacheAddCounters(LcCacheCounters* to, const LcCacheCounters* from) {
+    to->hits += from->hits;
+    to->misses += from->misses;
+    to->insertions += from->insertions;
+    to->evictions += from->evictions;
+    to->writebacks += from->writebacks;
+    to->lines += from->lines;
+    to->bytes += from->bytes;
+    to->zhits += from->zhits;
+    to->zlines += from->zlines;
+    to->zbytes += from->zbytes;
+    to->l2hits += from->l2hits;
+    to->l2lines += from->l2lines;
+    to->capacity += from->capacity;
+    to->resizes += from->resizes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheFindLine
+// Description  : Find the line holding a key using the hash index
+//
+// Inputs       : c - the cache
+//                key - packed (did, sec, blk)
+// Outputs      : the line index if found, LC_CACHE_NIL if not
+
+int32_t cacheFindLine(linkedList* c, uint64_t key) {
+    int32_t idx = c->buckets[cacheBucket(key, c->nbuckets)];
+    while (idx != LC_CACHE_NIL) {
+        if (c->lines[idx].key == key) {
+            return(idx);
+        }
+        idx = c->lines[idx].hnext;
+    }
+    return(LC_CACHE_NIL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheFreeLine
+// Description  : Take a line off the free list
+//
+// Inputs       : c - the cache
+// Outputs      : the line index, LC_CACHE_NIL if the shard is full
+
+int32_t cacheFreeLine(linkedList* c) {
+    int32_t idx = c->freelist;
+    if (idx != LC_CACHE_NIL) {
+        c->freelist = c->lines[idx].next;
+    }
+    return(idx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheEvictLine
+// Description  : Evict a resident line so it can be reused
+//
+// Inputs       : c - the cache
+//                idx - the line to evict
+// Outputs      : the line index, LC_CACHE_NIL if failure
+
+int32_t cacheEvictLine(linkedList* c, int32_t idx) {
+    if (idx == LC_CACHE_NIL || c->lines[idx].pins > 0) {
+        return(LC_CACHE_NIL);
+    }
+    if (c->lines[idx].dirty && cacheFlushLine(c, idx) != 0) {
+        return(LC_CACHE_NIL);
+    }
+    if (cacheRemoveLine(c, idx) != 0) {
+        return(LC_CACHE_NIL);
+    }
+    cacheCount(c, c->lines[idx].did, c->lines[idx].owner, LC_STAT_EVICTIONS);
+
+    // The line is clean now; keep copies in the lower tiers that are on
+    if (c->ztier.size > 0) {
+        zStore(c, &c->lines[idx]);
+    }
+    if (c->l2.nslots > 0) {
+        l2Store(c, &c->lines[idx]);
+    }
+    return(idx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheVictim
+// Description  : Get the least recently placed line of a list that is not
+//                pinned (the policies' eviction candidate)
+//
+// Inputs       : c - the cache
+//                list - the resident list
+// Outputs      : the line, LC_CACHE_NIL if every line is pinned or empty
+
+int32_t cacheVictim(linkedList* c, int list) {
+    int32_t idx = c->lists[list].tail;
+    while (idx != LC_CACHE_NIL && c->lines[idx].pins > 0) {
+        idx = c->lines[idx].prev;
+    }
+    return(idx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheFlushLine
+// Description  : Write a dirty line back to its device and mark it clean
+//
+// Inputs       : c - the cache
+//                idx - the line to write
+// Outputs      : 0 if successful, -1 if failure
+
+int cacheFlushLine(linkedList* c, int32_t idx) {
+    listNode* node = &c->lines[idx];
+    if (cacheWriteback == NULL ||
+        cacheWriteback(node->did, node->sec, node->blk, node->block) != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Cache writeback failed [did=%d, sec=%d, blk=%d]",
+            node->did, node->sec, node->blk);
+        return(-1);
+    }
+    node->dirty = 0;
+    cacheCount(c, node->did, node->owner, LC_STAT_WRITEBACKS);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheRemoveLine
+// Description  : Unlink a line from its list and the hash index
+//
+// Inputs       : c - the cache
+//                idx - the line to remove
+// Outputs      : 0 if successful, -1 if failure
+
+int cacheRemoveLine(linkedList* c, int32_t idx) {
+    listNode* node = &c->lines[idx];
+
+    // Remove from the hash chain
+    int32_t* link = &c->buckets[cacheBucket(node->key, c->nbuckets)];
+    while (*link != LC_CACHE_NIL && *link != idx) {
+        link = &c->lines[*link].hnext;
+    }
+    if (*link == LC_CACHE_NIL) {
+        return(-1);
+    }
+    *link = node->hnext;
+
+    // Remove from the resident list (and its owner's)
+    listUnlink(c, idx);
+    if (node->owner != LC_CACHE_NOOWNER) {
+        ownerUnlink(c, idx);
+    }
+    c->currentblocks --;
+    cacheCountLines(c, node->did, node->owner, -1);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : listPushHead
+// Description  : Put a line at the head of a resident list
+//
+// Inputs       : c - the cache
+//                list - the list to put it on
+//                idx - the line
+// Outputs      : none
+
+void listPushHead(linkedList* c, int list, int32_t idx) {
+    lcList* l = &c->lists[list];
+    listNode* node = &c->lines[idx];
+    node->list = (uint8_t)list;
+    node->prev = LC_CACHE_NIL;
+    node->next = l->head;
+    if (l->head == LC_CACHE_NIL) {
+        l->tail = idx;
+    } else {
+        c->lines[l->head].prev = idx;
+    }
+    l->head = idx;
+    l->count ++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : listUnlink
+// Description  : Take a line off its resident list
+//
+// Inputs       : c - the cache
+//                idx - the line
+// Outputs      : none
+
+void listUnlink(linkedList* c, int32_t idx) {
+    listNode* node = &c->lines[idx];
+    lcList* l = &c->lists[node->list];
+    if (node->prev != LC_CACHE_NIL) {
+        c->lines[node->prev].next = node->next;
+    } else {
+        l->head = node->next;
+    }
+    if (node->next != LC_CACHE_NIL) {
+        c->lines[node->next].prev = node->prev;
+    } else {
+        l->tail = node->prev;
+    }
+    l->count --;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : listMoveHead
+// Description  : Move a line to the head of a (possibly different) list
+//
+// Inputs       : c - the cache
+//                list - the list to move it to
+//                idx - the line
+// Outputs      : none
+
+void listMoveHead(linkedList* c, int list, int32_t idx) {
+    if (c->lines[idx].list == list && c->lists[list].head == idx) {
+        return;
+    }
+    listUnlink(c, idx);
+    listPushHead(c, list, idx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghostFind
+// Description  : Find the ghost entry for a key
+//
+// Inputs       : g - the ghosts
+//                key - packed (did, sec, blk)
+// Outputs      : the ghost index, LC_CACHE_NIL if not found
+
+int32_t ghostFind(lcGhosts* g, uint64_t key) {
+    if (g->capacity == 0) {
+        return(LC_CACHE_NIL);
+    }
+    int32_t gidx = g->buckets[cacheBucket(key, g->nbuckets)];
+    while (gidx != LC_CACHE_NIL && g->nodes[gidx].key != key) {
+        gidx = g->nodes[gidx].hnext;
+    }
+    return(gidx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghostPush
+// Description  : Remember an evicted key at the head of a ghost list. If no
+//                entry is free the oldest entry of the longer list is dropped.
+//
+// Inputs       : g - the ghosts
+//                list - the ghost list
+//                key - packed (did, sec, blk)
+// Outputs      : none
+
+void ghostPush(lcGhosts* g, int list, uint64_t key) {
+    if (g->capacity == 0) {
+        return;
+    }
+    if (g->freelist == LC_CACHE_NIL) {
+        ghostDropTail(g, (g->lists[0].count >= g->lists[1].count) ? 0 : 1);
+    }
+    int32_t gidx = g->freelist;
+    ghostNode* node = &g->nodes[gidx];
+    g->freelist = node->next;
+
+    uint32_t b = cacheBucket(key, g->nbuckets);
+    node->key = key;
+    node->hnext = g->buckets[b];
+    g->buckets[b] = gidx;
+
+    lcList* l = &g->lists[list];
+    node->list = (uint8_t)list;
+    node->prev = LC_CACHE_NIL;
+    node->next = l->head;
+    if (l->head == LC_CACHE_NIL) {
+        l->tail = gidx;
+    } else {
+        g->nodes[l->head].prev = gidx;
+    }
+    l->head = gidx;
+    l->count ++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghostRemove
+// Description  : Forget a ghost entry
+//
+// Inputs       : g - the ghosts
+//                gidx - the ghost entry
+// Outputs      : none
+
+void ghostRemove(lcGhosts* g, int32_t gidx) {
+    ghostNode* node = &g->nodes[gidx];
+
+    int32_t* link = &g->buckets[cacheBucket(node->key, g->nbuckets)];
+    while (*link != gidx) {
+        link = &g->nodes[*link].hnext;
+    }
+    *link = node->hnext;
+
+    lcList* l = &g->lists[node->list];
+    if (node->prev != LC_CACHE_NIL) {
+        g->nodes[node->prev].next = node->next;
+    } else {
+        l->head = node->next;
+    }
+    if (node->next != LC_CACHE_NIL) {
+        g->nodes[node->next].prev = node->prev;
+    } else {
+        l->tail = node->prev;
+    }
+    l->count --;
+
+    node->next = g->freelist;
+    g->freelist = gidx;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghostDropTail
+// Description  : Forget the oldest entry of a ghost list
+//
+// Inputs       : g - the ghosts
+//                list - the ghost list
+// Outputs      : none
+
+void ghostDropTail(lcGhosts* g, int list) {
+    if (g->lists[list].tail != LC_CACHE_NIL) {
+        ghostRemove(g, g->lists[list].tail);
+    }
+}
+
+//
+// Adaptive sizing
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sampleInit
+// Description  : Set up the sizing sampler. Every key is sampled while the
+//                tracked keys can cover the upper bound twice over; past
+//                that the rate drops so the sample stays the same size.
+//
+// Inputs       : s - the sampler
+//                cfg - the cache configuration
+//                maxblocks - the starting capacity
+//                nshards - the number of shards
+// Outputs      : 0 if successful, -1 if failure
+
+int sampleInit(lcSampler* s, const LcCacheConfig* cfg, int maxblocks, int nshards) {
+    memset(s, 0, sizeof(lcSampler));
+    pthread_mutex_init(&s->lock, NULL);
+    s->freelist = LC_CACHE_NIL;
+    if (cfg->targetmiss <= 0.0) {
+        return(0);
+    }
+    s->limitblocks = (cfg->limitblocks > 0) ? cfg->limitblocks : maxblocks * 4;
+    s->minblocks = (cfg->minblocks > 0) ? cfg->minblocks : CMPSC311_MAXVAL(maxblocks / 4, 1);
+    // Tiny shards hash too unevenly to follow a whole-cache estimate
+    s->minblocks = CMPSC311_MAXVAL(s->minblocks, nshards * LC_CACHE_MINSHARDBLOCKS);
+    s->minblocks = CMPSC311_MINVAL(s->minblocks, s->limitblocks);
+    s->target = cfg->targetmiss;
+    s->capacity = maxblocks;
+    s->binwidth = CMPSC311_MAXVAL((s->limitblocks + LC_CACHE_SAMPLEBINS - 1) / LC_CACHE_SAMPLEBINS, 1);
+
+    s->nbuckets = LC_CACHE_MINBUCKETS;
+    while (s->nbuckets < LC_CACHE_SAMPLEKEYS * 2) {
+        s->nbuckets <<= 1;
+    }
+    s->window = LC_CACHE_SAMPLEKEYS * 2;
+    s->keys = malloc(sizeof(lcSampleKey) * LC_CACHE_SAMPLEKEYS);
+    s->buckets = malloc(sizeof(int32_t) * s->nbuckets);
+    s->fenwick = calloc(s->window + 1, sizeof(uint32_t));
+    s->order = malloc(sizeof(uint64_t) * LC_CACHE_SAMPLEKEYS);
+    if (s->keys == NULL || s->buckets == NULL || s->fenwick == NULL || s->order == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Cache: sizing sampler allocation failed");
+        sampleFree(s);
+        return(-1);
+    }
+    for (uint32_t i = 0; i < s->nbuckets; i++) {
+        s->buckets[i] = LC_CACHE_NIL;
+    }
+    for (int i = 0; i < LC_CACHE_SAMPLEKEYS; i++) {
+        s->keys[i].hnext = (i + 1 < LC_CACHE_SAMPLEKEYS) ? i + 1 : LC_CACHE_NIL;
+        s->keys[i].time = UINT32_MAX;
+    }
+    s->freelist = 0;
+    s->threshold = (uint32_t)CMPSC311_MINVAL((uint64_t)LC_CACHE_SAMPLEMOD * LC_CACHE_SAMPLEKEYS / 2 /
+        s->limitblocks, (uint64_t)LC_CACHE_SAMPLEMOD);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sampleFree
+// Description  : Release the sizing sampler
+//
+// Inputs       : s - the sampler
+// Outputs      : none
+
+void sampleFree(lcSampler* s) {
+    free(s->keys);
+    free(s->buckets);
+    free(s->fenwick);
+    free(s->order);
+    pthread_mutex_destroy(&s->lock);
+    memset(s, 0, sizeof(lcSampler));
+}
+
+// Add to a reference slot's count (Fenwick tree, slots from 1)
+static inline void sampleMark(lcSampler* s, uint32_t slot, int delta) {
+    for (; slot <= s->window; slot += slot & (~slot + 1)) {
+        s->fenwick[slot] += delta;
+    }
+}
+
+// Count the marked slots in 1..slot
+static inline uint32_t sampleCount(lcSampler* s, uint32_t slot) {
+    uint32_t n = 0;
+    for (; slot > 0; slot -= slot & (~slot + 1)) {
+        n += s->fenwick[slot];
+    }
+    return(n);
+}
+
+// Order reference slots (qsort)
+static int sampleCompare(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return((x > y) - (x < y));
+}
+
+// Forget a tracked key
+static void sampleDrop(lcSampler* s, int32_t k) {
+    int32_t* link = &s->buckets[cacheBucket(s->keys[k].key, s->nbuckets)];
+    while (*link != k) {
+        link = &s->keys[*link].hnext;
+    }
+    *link = s->keys[k].hnext;
+    sampleMark(s, s->keys[k].time + 1, -1);
+    s->keys[k].time = UINT32_MAX;
+    s->keys[k].hnext = s->freelist;
+    s->freelist = k;
+    s->nkeys --;
+}
+
+// Renumber the live keys' slots 0..nkeys-1 when the slots run out
+static void sampleCompact(lcSampler* s) {
+    int n = 0;
+    for (int32_t k = 0; k < LC_CACHE_SAMPLEKEYS; k++) {
+        if (s->keys[k].time != UINT32_MAX) {
+            s->order[n++] = ((uint64_t)s->keys[k].time << 32) | (uint32_t)k;
+        }
+    }
+    qsort(s->order, n, sizeof(uint64_t), sampleCompare);
+    memset(s->fenwick, 0, sizeof(uint32_t) * (s->window + 1));
+    for (int i = 0; i < n; i++) {
+        s->keys[(uint32_t)s->order[i]].time = (uint32_t)i;
+        sampleMark(s, i + 1, 1);
+    }
+    s->now = (uint32_t)n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sampleReference
+// Description  : Account a reference to a sampled key and, at the end of an
+//                epoch, resize the cache to the estimated best capacity
+//
+// Inputs       : s - the sampler
+//                key - packed (did, sec, blk)
+//                hash - the sampling hash of the key
+// Outputs      : none
+
+void sampleReference(lcSampler* s, uint64_t key, uint32_t hash) {
+    int resize = 0;
+
+    pthread_mutex_lock(&s->lock);
+    int32_t k = s->buckets[cacheBucket(key, s->nbuckets)];
+    while (k != LC_CACHE_NIL && s->keys[k].key != key) {
+        k = s->keys[k].hnext;
+    }
+
+    // A full sample drops its highest hashes and samples less from now on
+    if (k == LC_CACHE_NIL && s->freelist == LC_CACHE_NIL) {
+        uint32_t top = 0;
+        for (int32_t i = 0; i < LC_CACHE_SAMPLEKEYS; i++) {
+            top = CMPSC311_MAXVAL(top, s->keys[i].hash);
+        }
+        __atomic_store_n(&s->threshold, top, __ATOMIC_RELAXED);
+        for (int32_t i = 0; i < LC_CACHE_SAMPLEKEYS; i++) {
+            if (s->keys[i].time != UINT32_MAX && s->keys[i].hash >= top) {
+                sampleDrop(s, i);
+            }
+        }
+    }
+    if (hash >= s->threshold) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    if (s->now == s->window) {
+        sampleCompact(s);
+    }
+
+    // Reuse distance in blocks, scaled up by the sampling rate
+    double weight = (double)LC_CACHE_SAMPLEMOD / s->threshold;
+    if (k != LC_CACHE_NIL) {
+        uint32_t d = sampleCount(s, s->now) - sampleCount(s, s->keys[k].time + 1);
+        int bin = (int)(d * weight / s->binwidth);
+        s->hist[CMPSC311_MINVAL(bin, LC_CACHE_SAMPLEBINS)] += weight;
+        sampleMark(s, s->keys[k].time + 1, -1);
+    } else {
+        k = s->freelist;
+        s->freelist = s->keys[k].hnext;
+        uint32_t b = cacheBucket(key, s->nbuckets);
+        s->keys[k].key = key;
+        s->keys[k].hash = hash;
+        s->keys[k].hnext = s->buckets[b];
+        s->buckets[b] = k;
+        s->nkeys ++;
+        s->cold += weight;
+    }
+    s->keys[k].time = s->now;
+    sampleMark(s, s->now + 1, 1);
+    s->now ++;
+    s->refs += weight;
+
+    // Resize at the end of the epoch, then decay the history
+    if (++s->epoch >= LC_CACHE_SAMPLEEPOCH) {
+        int capacity = sampleCapacity(s);
+        if (abs(capacity - s->capacity) > s->capacity / 16) {
+            s->capacity = capacity;
+            s->resizes ++;
+            resize = capacity;
+        }
+        for (int i = 0; i <= LC_CACHE_SAMPLEBINS; i++) {
+            s->hist[i] /= 2;
+        }
+        s->cold /= 2;
+        s->refs /= 2;
+        s->epoch = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    // Outside the sampler lock, the shards are locked one by one
+    if (resize > 0) {
+        cacheResize(resize);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sampleCapacity
+// Description  : Pick the capacity from the estimated miss-ratio curve: the
+//                smallest within the bounds that meets the target, or, if
+//                none does, the smallest within LC_CACHE_ADAPTSLACK of the
+//                largest (more memory would not buy much)
+//
+// Inputs       : s - the sampler (locked)
+// Outputs      : the capacity
+
+int sampleCapacity(lcSampler* s) {
+    double tail[LC_CACHE_SAMPLEBINS + 2];
+    int first = (s->minblocks + s->binwidth - 1) / s->binwidth;
+    int last = CMPSC311_MINVAL(s->limitblocks / s->binwidth, LC_CACHE_SAMPLEBINS);
+
+    if (s->refs <= 0.0) {
+        return(s->capacity);
+    }
+
+    // A reference at distance d misses in a cache of size k * binwidth
+    // when its bin is k or more
+    tail[LC_CACHE_SAMPLEBINS + 1] = 0.0;
+    for (int i = LC_CACHE_SAMPLEBINS; i >= 0; i--) {
+        tail[i] = tail[i + 1] + s->hist[i];
+    }
+    double goal = CMPSC311_MAXVAL(s->target, (s->cold + tail[last]) / s->refs + LC_CACHE_ADAPTSLACK);
+    for (int k = first; k < last; k++) {
+        if ((s->cold + tail[k]) / s->refs <= goal) {
+            return(CMPSC311_MAXVAL(k * s->binwidth, s->minblocks));
+        }
+    }
+    return(s->limitblocks);
+}
+
+//
+// Local disk cache
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2Open
+// Description  : Create (or reuse) and map the local disk cache file. The
+//                contents are not indexed across runs, so the cache starts
+//                empty each time.
+//
+// Inputs       : path - the cache file
+//                l2blocks - the size in blocks
+// Outputs      : 0 if successful, -1 if failure
+
+int l2Open(const char* path, int l2blocks) {
+    size_t size = (size_t)l2blocks * LC_DEVICE_BLOCK_SIZE;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        logMessage(LOG_ERROR_LEVEL, "Cache: local disk cache open failed [%s]", path);
+        return(-1);
+    }
+    if (ftruncate(fd, (off_t)size) != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Cache: local disk cache resize failed [%s]", path);
+        close(fd);
+        return(-1);
+    }
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL, "Cache: local disk cache map failed [%s]", path);
+        return(-1);
+    }
+    cache->l2map = map;
+    cache->l2size = size;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2Init
+// Description  : Set up a shard's part of the local disk cache
+//
+// Inputs       : l2 - the shard's local disk cache
+//                data - its region of the mapped file
+//                nslots - its size in blocks
+// Outputs      : 0 if successful, -1 if failure
+
+int l2Init(lcL2* l2, char* data, int nslots) {
+    l2->nbuckets = LC_CACHE_MINBUCKETS;
+    while (l2->nbuckets < (uint32_t)nslots * 2) {
+        l2->nbuckets <<= 1;
+    }
+    l2->slots = calloc(nslots, sizeof(l2Slot));
+    l2->buckets = malloc(sizeof(int32_t) * l2->nbuckets);
+    if (l2->slots == NULL || l2->buckets == NULL) {
+        free(l2->slots);
+        free(l2->buckets);
+        memset(l2, 0, sizeof(lcL2));
+        return(-1);
+    }
+    for (uint32_t i = 0; i < l2->nbuckets; i++) {
+        l2->buckets[i] = LC_CACHE_NIL;
+    }
+    l2->data = data;
+    l2->nslots = nslots;
+    l2->hand = 0;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2Find
+// Description  : Find a block in the local disk cache
+//
+// Inputs       : l2 - the shard's local disk cache
+//                key - packed (did, sec, blk)
+// Outputs      : the slot, LC_CACHE_NIL if not found
+
+int32_t l2Find(lcL2* l2, uint64_t key) {
+    if (l2->nslots == 0) {
+        return(LC_CACHE_NIL);
+    }
+    int32_t slot = l2->buckets[cacheBucket(key, l2->nbuckets)];
+    while (slot != LC_CACHE_NIL && l2->slots[slot].key != key) {
+        slot = l2->slots[slot].hnext;
+    }
+    return(slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2Store
+// Description  : Copy a clean line being evicted to the local disk cache.
+//                A block already there is refreshed (the line may have been
+//                written since) and marked referenced; otherwise the CLOCK
+//                hand picks the slot, passing over (and clearing)
+//                referenced ones.
+//
+// Inputs       : c - the shard
+//                line - the line being evicted
+// Outputs      : none
+
+void l2Store(linkedList* c, listNode* line) {
+    lcL2* l2 = &c->l2;
+    int32_t slot = l2Find(l2, line->key);
+
+    if (slot != LC_CACHE_NIL) {
+        memcpy(&l2->data[(size_t)slot * LC_DEVICE_BLOCK_SIZE], line->block, LC_DEVICE_BLOCK_SIZE);
+        l2->slots[slot].ref = 1;
+        return;
+    }
+    while (l2->slots[l2->hand].used && l2->slots[l2->hand].ref) {
+        l2->slots[l2->hand].ref = 0;
+        l2->hand = (l2->hand + 1) % l2->nslots;
+    }
+    slot = l2->hand;
+    l2->hand = (l2->hand + 1) % l2->nslots;
+    if (l2->slots[slot].used) {
+        l2Remove(c, slot);
+    }
+
+    memcpy(&l2->data[(size_t)slot * LC_DEVICE_BLOCK_SIZE], line->block, LC_DEVICE_BLOCK_SIZE);
+    uint32_t b = cacheBucket(line->key, l2->nbuckets);
+    l2->slots[slot].key = line->key;
+    l2->slots[slot].hnext = l2->buckets[b];
+    l2->slots[slot].used = 1;
+    l2->slots[slot].ref = 0;
+    l2->buckets[b] = slot;
+    c->total.l2lines ++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2Remove
+// Description  : Forget a block in the local disk cache
+//
+// Inputs       : c - the shard
+//                slot - the slot
+// Outputs      : none
+
+void l2Remove(linkedList* c, int32_t slot) {
+    lcL2* l2 = &c->l2;
+    int32_t* link = &l2->buckets[cacheBucket(l2->slots[slot].key, l2->nbuckets)];
+    while (*link != slot) {
+        link = &l2->slots[*link].hnext;
+    }
+    *link = l2->slots[slot].hnext;
+    l2->slots[slot].used = 0;
+    l2->slots[slot].ref = 0;
+    c->total.l2lines --;
+}
+
+//
+// Compressed tier
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : zInit
+// Description  : Set up the compressed tier of a shard. A budget too small
+//                to hold a few blocks leaves the tier off.
+//
+// Inputs       : z - the tier
+//                bytes - the ring size
+// Outputs      : 0 if successful, -1 if failure
+
+int zInit(lcZTier* z, uint32_t bytes) {
+    memset(z, 0, sizeof(lcZTier));
+    z->freelist = LC_CACHE_NIL;
+    bytes -= bytes % LC_CACHE_ZALIGN;
+    if (bytes < 4 * LC_DEVICE_BLOCK_SIZE) {
+        return(0);
+    }
+
+    // Code table for packing payload characters
+    memset(zCharCode, LC_CACHE_ZNOCODE, sizeof(zCharCode));
+    for (int i = 0; zChars[i] != '\0'; i++) {
+        zCharCode[(uint8_t)zChars[i]] = (uint8_t)i;
+    }
+
+    z->capacity = CMPSC311_MAXVAL(bytes / LC_CACHE_ZNODEBYTES, 1);
+    z->nbuckets = LC_CACHE_MINBUCKETS;
+    while (z->nbuckets < (uint32_t)z->capacity * 2) {
+        z->nbuckets <<= 1;
+    }
+    z->ring = malloc(bytes);
+    z->nodes = malloc(sizeof(zNode) * z->capacity);
+    z->buckets = malloc(sizeof(int32_t) * z->nbuckets);
+    if (z->ring == NULL || z->nodes == NULL || z->buckets == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Cache: compressed tier allocation failed (%u bytes)", bytes);
+        free(z->ring);
+        free(z->nodes);
+        free(z->buckets);
+        memset(z, 0, sizeof(lcZTier));
+        return(-1);
+    }
+    for (uint32_t i = 0; i < z->nbuckets; i++) {
+        z->buckets[i] = LC_CACHE_NIL;
+    }
+    for (int i = 0; i < z->capacity; i++) {
+        z->nodes[i].hnext = (i + 1 < z->capacity) ? i + 1 : LC_CACHE_NIL;
+    }
+    z->freelist = 0;
+    z->size = bytes;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : zFind
+// Description  : Find the compressed copy of a block
+//
+// Inputs       : z - the tier
+//                key - packed (did, sec, blk)
+// Outputs      : the index node, LC_CACHE_NIL if not found
+
+int32_t zFind(lcZTier* z, uint64_t key) {
+    if (z->count == 0) {
+        return(LC_CACHE_NIL);
+    }
+    int32_t zidx = z->buckets[cacheBucket(key, z->nbuckets)];
+    while (zidx != LC_CACHE_NIL && z->nodes[zidx].key != key) {
+        zidx = z->nodes[zidx].hnext;
+    }
+    return(zidx);
+}
+
+// Ring bytes taken by an entry with len bytes of data
+static inline uint32_t zEntrySize(uint32_t len) {
+    uint32_t n = (uint32_t)sizeof(zEntry) + len;
+    return((n + LC_CACHE_ZALIGN - 1) & ~(uint32_t)(LC_CACHE_ZALIGN - 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : zStore
+// Description  : Compress a clean line into the tier, dropping the oldest
+//                entries to make room. Blocks that do not compress are not
+//                kept.
+//
+// Inputs       : c - the shard
+//                line - the line being evicted
+// Outputs      : 0 if stored, -1 if not
+
+int zStore(linkedList* c, listNode* line) {
+    lcZTier* z = &c->ztier;
+    uint8_t data[LC_DEVICE_BLOCK_SIZE * 2];
+
+    int32_t zidx = zFind(z, line->key);
+    if (zidx != LC_CACHE_NIL) {
+        zRemove(c, zidx);
+    }
+    int len = zCompress(line->block, data);
+    if (len >= LC_DEVICE_BLOCK_SIZE) {
+        return(-1);
+    }
+    uint32_t need = zEntrySize((uint32_t)len);
+
+    // Make room: a free index node and a contiguous run of need bytes
+    while (z->freelist == LC_CACHE_NIL) {
+        if (zDropTail(c) != 0) {
+            return(-1);
+        }
+    }
+    for (;;) {
+        if (z->used == 0) {
+            z->head = z->tail = 0;
+        }
+        if (z->used < z->size && z->head >= z->tail) {
+            // Free space runs from head to the end, then up to tail
+            uint32_t room = z->size - z->head;
+            if (room >= need) {
+                break;
+            }
+            if (room >= sizeof(zEntry)) {
+                zEntry* wrap = (zEntry *)&z->ring[z->head];
+                wrap->node = LC_CACHE_NIL;
+                wrap->len = LC_CACHE_ZWRAP;
+            }
+            z->used += room;
+            z->head = 0;
+            continue;
+        }
+        if (z->used < z->size && z->tail - z->head >= need) {
+            break;
+        }
+        if (zDropTail(c) != 0) {
+            return(-1);
+        }
+    }
+
+    // Write the entry and index it
+    zEntry* e = (zEntry *)&z->ring[z->head];
+    e->len = (uint16_t)len;
+    e->unused = 0;
+    memcpy(&e[1], data, len);
+    zidx = z->freelist;
+    zNode* node = &z->nodes[zidx];
+    z->freelist = node->hnext;
+    e->node = zidx;
+    node->key = line->key;
+    node->off = z->head;
+    uint32_t b = cacheBucket(line->key, z->nbuckets);
+    node->hnext = z->buckets[b];
+    z->buckets[b] = zidx;
+    z->count ++;
+    z->used += need;
+    z->head += need;
+    if (z->head == z->size) {
+        z->head = 0;
+    }
+    c->total.zlines ++;
+    c->total.zbytes += need;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : zRemove
+// Description  : Forget a compressed block. Its ring space is reclaimed
+//                when the tail passes it.
+//
+// Inputs       : c - the shard
+//                zidx - the index node
+// Outputs      : none
+
+void zRemove(linkedList* c, int32_t zidx) {
+    lcZTier* z = &c->ztier;
+    zNode* node = &z->nodes[zidx];
+    zEntry* e = (zEntry *)&z->ring[node->off];
+
+    int32_t* link = &z->buckets[cacheBucket(node->key, z->nbuckets)];
+    while (*link != zidx) {
+        link = &z->nodes[*link].hnext;
+    }
+    *link = node->hnext;
+    c->total.zlines --;
+    c->total.zbytes -= zEntrySize(e->len);
+    e->node = LC_CACHE_NIL;
+
+    node->hnext = z->freelist;
+    z->freelist = zidx;
+    z->count --;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : zDropTail
+// Description  : Reclaim the oldest entry (or the end-of-ring padding)
+//
+// Inputs       : c - the shard
+// Outputs      : 0 if successful, -1 if the ring is empty
+
+int zDropTail(linkedList* c) {
+    lcZTier* z = &c->ztier;
+
+    if (z->used == 0) {
+        return(-1);
+    }
+    zEntry* e = (zEntry *)&z->ring[z->tail];
+    if (z->size - z->tail < sizeof(zEntry) || e->len == LC_CACHE_ZWRAP) {
+        z->used -= z->size - z->tail;
+        z->tail = 0;
+        return(0);
+    }
+    uint32_t n = zEntrySize(e->len);
+    if (e->node != LC_CACHE_NIL) {
+        zRemove(c, e->node);
+    }
+    z->used -= n;
+    z->tail += n;
+    if (z->tail == z->size) {
+        z->tail = 0;
+    }
+    return(0);
+}
+
+// Append a varint (7 bits per byte, low bits first)
+static inline int zPutVarint(uint8_t* out, uint32_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return(n);
+}
+
+// Read a varint written by zPutVarint
+static inline int zGetVarint(const uint8_t* in, uint32_t* v) {
+    int n = 0;
+    *v = 0;
+    do {
+        *v |= (uint32_t)(in[n] & 0x7f) << (7 * n);
+    } while (in[n++] & 0x80);
+    return(n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : zCompress
+// Description  : Compress a block. Trailing zeros are dropped, and a block
+//                made only of CMPSC311_ALLCHARS characters is packed seven
+//                characters to 46 bits.
+//
+// Inputs       : block - the block
+//                out - the output (at least 2 blocks long)
+// Outputs      : the compressed length
+
+int zCompress(const char* block, uint8_t* out) {
+    const uint8_t* payload = (const uint8_t *)block;
+    int plen = LC_DEVICE_BLOCK_SIZE;
+    int n = 1, packed = 1;
+
+    while (plen > 0 && payload[plen - 1] == 0) {
+        plen --;
+    }
+    n += zPutVarint(&out[n], (uint32_t)plen);
+    for (int i = 0; i < plen && packed; i++) {
+        packed = (zCharCode[payload[i]] != LC_CACHE_ZNOCODE);
+    }
+    out[0] = (uint8_t)packed;
+
+    if (!packed) {
+        memcpy(&out[n], payload, plen);
+        return(n + plen);
+    }
+    uint64_t bits = 0;
+    int nbits = 0;
+    for (int i = 0; i < plen; i += LC_CACHE_ZGROUP) {
+        uint64_t group = 0;
+        for (int j = CMPSC311_MINVAL(i + LC_CACHE_ZGROUP, plen) - 1; j >= i; j--) {
+            group = group * (sizeof(zChars) - 1) + zCharCode[payload[j]];
+        }
+        bits |= group << nbits;
+        nbits += LC_CACHE_ZGROUPBITS;
+        while (nbits >= 8) {
+            out[n++] = (uint8_t)bits;
+            bits >>= 8;
+            nbits -= 8;
+        }
+    }
+    if (nbits > 0) {
+        out[n++] = (uint8_t)bits;
+    }
+    return(n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : zDecompress
+// Description  : Rebuild a block compressed by zCompress
+//
+// Inputs       : in - the compressed block
+//                len - the compressed length
+//                block - the block to fill
+// Outputs      : 0 if successful
+
+int zDecompress(const uint8_t* in, int len, char* block) {
+    uint8_t* payload = (uint8_t *)block;
+    uint32_t plen;
+    int n = 1;
+
+    memset(block, 0, LC_DEVICE_BLOCK_SIZE);
+    n += zGetVarint(&in[n], &plen);
+    if (!in[0]) {
+        memcpy(payload, &in[n], plen);
+        return(0);
+    }
+    uint64_t bits = 0;
+    int nbits = 0;
+    for (uint32_t i = 0; i < plen; i += LC_CACHE_ZGROUP) {
+        while (nbits < LC_CACHE_ZGROUPBITS && n < len) {
+            bits |= (uint64_t)in[n++] << nbits;
+            nbits += 8;
+        }
+        uint64_t group = bits & (((uint64_t)1 << LC_CACHE_ZGROUPBITS) - 1);
+        bits >>= LC_CACHE_ZGROUPBITS;
+        nbits -= LC_CACHE_ZGROUPBITS;
+        for (uint32_t j = i; j < i + LC_CACHE_ZGROUP && j < plen; j++) {
+            payload[j] = (uint8_t)zChars[group % (sizeof(zChars) - 1)];
+            group /= (sizeof(zChars) - 1);
+        }
+    }
+    return(0);
+}
+
+//
+// Replacement policies
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Policy       : LRU
+// Description  : Strict least-recently-used, one list
+
+static void lruHit(linkedList* c, int32_t idx) {
+    listMoveHead(c, LC_LIST_LRU, idx);
+}
+
+static int32_t lruMiss(linkedList* c, uint64_t key) {
+    int32_t idx = cacheFreeLine(c);
+    if (idx == LC_CACHE_NIL) {
+        idx = cacheEvictLine(c, cacheVictim(c, LC_LIST_LRU));
+    }
+    if (idx != LC_CACHE_NIL) {
+        listPushHead(c, LC_LIST_LRU, idx);
+    }
+    return(idx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Policy       : 2Q
+// Description  : Full 2Q (Johnson & Shasha). New blocks go through a FIFO
+//                (A1in, 1/4 of the lines); only blocks referenced again after
+//                leaving it (found in the A1out ghost list, 1/2 of the lines)
+//                are promoted to the main LRU list (Am). One-pass streams
+//                therefore never displace Am.
+
+static void twoqHit(linkedList* c, int32_t idx) {
+    if (c->lines[idx].list == LC_LIST_AM) {
+        listMoveHead(c, LC_LIST_AM, idx);
+    }
+}
+
+static int32_t twoqMiss(linkedList* c, uint64_t key) {
+    lcGhosts* g = &c->ghosts;
+    int kin = CMPSC311_MAXVAL(c->maxblocks / 4, 1);
+    int kout = CMPSC311_MAXVAL(c->maxblocks / 2, 1);
+    int32_t idx = cacheFreeLine(c);
+
+    if (idx == LC_CACHE_NIL) {
+        int32_t victim = cacheVictim(c, LC_LIST_A1IN);
+        if (victim != LC_CACHE_NIL &&
+            (c->lists[LC_LIST_A1IN].count > kin || c->lists[LC_LIST_AM].count == 0)) {
+            // Page out of A1in, remember it in A1out
+            uint64_t old = c->lines[victim].key;
+            if ((idx = cacheEvictLine(c, victim)) != LC_CACHE_NIL) {
+                ghostPush(g, LC_GHOST_A1OUT, old);
+            }
+            while (g->lists[LC_GHOST_A1OUT].count > kout) {
+                ghostDropTail(g, LC_GHOST_A1OUT);
+            }
+        } else if ((victim = cacheVictim(c, LC_LIST_AM)) != LC_CACHE_NIL) {
+            idx = cacheEvictLine(c, victim);
+        } else {
+            idx = cacheEvictLine(c, cacheVictim(c, LC_LIST_A1IN));
+        }
+        if (idx == LC_CACHE_NIL) {
+            return(LC_CACHE_NIL);
+        }
+    }
+
+    int32_t gidx = ghostFind(g, key);
+    if (gidx != LC_CACHE_NIL) {
+        ghostRemove(g, gidx);
+        listPushHead(c, LC_LIST_AM, idx);
+    } else {
+        listPushHead(c, LC_LIST_A1IN, idx);
+    }
+    return(idx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Policy       : ARC
+// Description  : Adaptive replacement cache (Megiddo & Modha). T1 holds
+//                blocks seen once, T2 blocks seen twice or more; the ghost
+//                lists B1/B2 steer the target size p of T1.
+
+// Evict from T1 or T2 depending on the target p (ARC's REPLACE)
+static int32_t arcReplace(linkedList* c, int inB2) {
+    lcList* t1 = &c->lists[LC_LIST_T1];
+    int32_t v1 = cacheVictim(c, LC_LIST_T1), v2 = cacheVictim(c, LC_LIST_T2);
+    int32_t idx = LC_CACHE_NIL;
+    if (v1 != LC_CACHE_NIL && (t1->count > c->arcp || (inB2 && t1->count == c->arcp) ||
+        v2 == LC_CACHE_NIL)) {
+        uint64_t old = c->lines[v1].key;
+        if ((idx = cacheEvictLine(c, v1)) != LC_CACHE_NIL) {
+            ghostPush(&c->ghosts, LC_GHOST_B1, old);
+        }
+    } else if (v2 != LC_CACHE_NIL) {
+        uint64_t old = c->lines[v2].key;
+        if ((idx = cacheEvictLine(c, v2)) != LC_CACHE_NIL) {
+            ghostPush(&c->ghosts, LC_GHOST_B2, old);
+        }
+    }
+    return(idx);
+}
+
+static void arcHit(linkedList* c, int32_t idx) {
+    listMoveHead(c, LC_LIST_T2, idx);
+}
+
+static int32_t arcMiss(linkedList* c, uint64_t key) {
+    lcGhosts* g = &c->ghosts;
+    int size = c->maxblocks;
+    int b1 = g->lists[LC_GHOST_B1].count, b2 = g->lists[LC_GHOST_B2].count;
+    int t1 = c->lists[LC_LIST_T1].count, t2 = c->lists[LC_LIST_T2].count;
+    int32_t gidx = ghostFind(g, key), idx = LC_CACHE_NIL;
+
+    if (gidx != LC_CACHE_NIL) {
+        // Ghost hit: adapt p towards the list that would have hit
+        int inB2 = (g->nodes[gidx].list == LC_GHOST_B2);
+        if (inB2) {
+            c->arcp = CMPSC311_MAXVAL(c->arcp - CMPSC311_MAXVAL(b1 / CMPSC311_MAXVAL(b2, 1), 1), 0);
+        } else {
+            c->arcp = CMPSC311_MINVAL(c->arcp + CMPSC311_MAXVAL(b2 / CMPSC311_MAXVAL(b1, 1), 1), size);
+        }
+        ghostRemove(g, gidx);
+        if ((idx = cacheFreeLine(c)) == LC_CACHE_NIL) {
+            idx = arcReplace(c, inB2);
+        }
+        if (idx != LC_CACHE_NIL) {
+            listPushHead(c, LC_LIST_T2, idx);
+        }
+        return(idx);
+    }
+
+    // Complete miss: keep |T1|+|B1| <= c and the directory <= 2c
+    if (t1 + b1 >= size) {
+        if (t1 < size) {
+            ghostDropTail(g, LC_GHOST_B1);
+            if ((idx = cacheFreeLine(c)) == LC_CACHE_NIL) {
+                idx = arcReplace(c, 0);
+            }
+        } else if ((idx = cacheEvictLine(c, cacheVictim(c, LC_LIST_T1))) == LC_CACHE_NIL) {
+            idx = arcReplace(c, 0);
+        }
+    } else {
+        if (t1 + t2 + b1 + b2 >= size) {
+            if (t1 + t2 + b1 + b2 >= 2 * size) {
+                ghostDropTail(g, LC_GHOST_B2);
+            }
+        }
+        if ((idx = cacheFreeLine(c)) == LC_CACHE_NIL) {
+            idx = arcReplace(c, 0);
+        }
+    }
+    if (idx != LC_CACHE_NIL) {
+        listPushHead(c, LC_LIST_T1, idx);
+    }
+    return(idx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Policy       : LFU
+// Description  : LFU with logarithmic frequency classes and aging. Lines are
+//                kept on one LRU list per class (count 1, 2-3, 4-7, ...);
+//                the victim is the LRU line of the lowest class. All counts
+//                are halved every LC_CACHE_LFU_AGING x capacity misses so
+//                blocks that were hot long ago do not stay forever.
+
+static int lfuClass(uint16_t freq) {
+    int cls = 0;
+    while (freq > 1 && cls < LC_CACHE_MAXLISTS - 1) {
+        freq >>= 1;
+        cls ++;
+    }
+    return(cls);
+}
+
+static void lfuAge(linkedList* c) {
+    // Re-file every line, oldest first, so recency order is kept per class.
+    // Halving never raises a class, so the lines of class l are popped off
+    // its tail once each before any later class pushes onto it.
+    for (int l = 0; l < LC_CACHE_MAXLISTS; l++) {
+        for (int n = c->lists[l].count; n > 0; n--) {
+            int32_t idx = c->lists[l].tail;
+            listNode* node = &c->lines[idx];
+            listUnlink(c, idx);
+            node->freq = (uint16_t)((node->freq + 1) / 2);
+            listPushHead(c, lfuClass(node->freq), idx);
+        }
+    }
+    c->misses = 0;
+}
+
+static void lfuHit(linkedList* c, int32_t idx) {
+    listNode* node = &c->lines[idx];
+    if (node->freq < UINT16_MAX) {
+        node->freq ++;
+    }
+    listMoveHead(c, lfuClass(node->freq), idx);
+}
+
+static int32_t lfuMiss(linkedList* c, uint64_t key) {
+    if (++c->misses >= c->maxblocks * LC_CACHE_LFU_AGING) {
+        lfuAge(c);
+    }
+    int32_t idx = cacheFreeLine(c);
+    if (idx == LC_CACHE_NIL) {
+        for (int l = 0; l < LC_CACHE_MAXLISTS && idx == LC_CACHE_NIL; l++) {
+            idx = cacheEvictLine(c, cacheVictim(c, l));
+        }
+    }
+    if (idx != LC_CACHE_NIL) {
+        c->lines[idx].freq = 1;
+        listPushHead(c, lfuClass(1), idx);
+    }
+    return(idx);
+}
+
+//
+// Policy table (indexed by LcCachePolicyType)
+
+static const lcCachePolicy lcPolicyLRU = { lruHit, lruMiss, 0 };
+static const lcCachePolicy lcPolicy2Q = { twoqHit, twoqMiss, 1 };
+static const lcCachePolicy lcPolicyARC = { arcHit, arcMiss, 1 };
+static const lcCachePolicy lcPolicyLFU = { lfuHit, lfuMiss, 0 };
+
+const lcCachePolicy* lcCachePolicies[LC_CACHE_MAXPOLICY] = {
+    &lcPolicyLRU, &lcPolicy2Q, &lcPolicyARC, &lcPolicyLFU
+};
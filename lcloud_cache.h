@@ -17,20 +17,147 @@
 
 // Defines 
 #define LC_CACHE_MAXBLOCKS 64
+#define LC_CACHE_MAXSHARDS 16       // Most shards the cache is split into
+#define LC_CACHE_MINSHARDBLOCKS 64  // Smallest shard lcloud_initcache makes
+#define LC_CACHE_POLICY_ENV "LCLOUD_CACHE_POLICY" // Overrides the policy
+#define LC_CACHE_WRITEBACK_ENV "LCLOUD_CACHE_WRITEBACK" // 1 for write-back
+#define LC_CACHE_SNAPSHOT_ENV "LCLOUD_CACHE_SNAPSHOT" // Snapshot file path
+#define LC_CACHE_STAMP_ENV "LCLOUD_CACHE_STAMP" // Device state generation
+#define LC_CACHE_ZBLOCKS_ENV "LCLOUD_CACHE_ZBLOCKS" // Compressed tier budget
+#define LC_CACHE_L2FILE_ENV "LCLOUD_CACHE_L2FILE" // Local disk cache file
+#define LC_CACHE_L2BLOCKS_ENV "LCLOUD_CACHE_L2BLOCKS" // Local disk cache size
+#define LC_CACHE_FILEQUOTA_ENV "LCLOUD_CACHE_FILEQUOTA" // Per-file share, percent
+#define LC_CACHE_TARGETMISS_ENV "LCLOUD_CACHE_TARGETMISS" // Adaptive sizing target
+#define LC_CACHE_MINBLOCKS_ENV "LCLOUD_CACHE_MINBLOCKS" // Adaptive lower bound
+#define LC_CACHE_MAXBLOCKS_ENV "LCLOUD_CACHE_MAXBLOCKS" // Adaptive upper bound
+#define LC_CACHE_MAXDEVICES 16      // Devices broken out in the statistics
+#define LC_CACHE_NOOWNER 0          // Owner of lines not tied to a file
+
+// Type definitions
+
+// Replacement policies
+typedef enum {
+    LC_CACHE_LRU        = 0,   // Least recently used
+    LC_CACHE_2Q         = 1,   // 2Q, scan resistant
+    LC_CACHE_ARC        = 2,   // Adaptive replacement cache, scan resistant
+    LC_CACHE_LFU        = 3,   // Least frequently used (with aging)
+    LC_CACHE_MAXPOLICY  = 4    // Maximum policy number
+} LcCachePolicyType;
+
+// Cache configuration (see lcloud_cacheconfig for defaults)
+typedef struct {
+    int maxblocks;              // Capacity in blocks
+    int nshards;                // Number of shards, 0 to pick automatically
+    LcCachePolicyType policy;   // Replacement policy
+    int writeback;              // 1 write-back, 0 write-through
+    const char *snapshot;       // File to warm start from and save to, or NULL
+    uint64_t stamp;             // Device state the snapshot must match
+    int zblocks;                // Compressed tier memory, in raw blocks (0 off)
+    const char *l2file;         // Local disk cache file, or NULL for none
+    int l2blocks;               // Local disk cache size in blocks
+    int filequota;              // Percent of a full cache one file may hold (0 off)
+    double targetmiss;          // Adaptive sizing target miss ratio (0 off)
+    int minblocks;              // Adaptive sizing lower bound (0 for maxblocks/4)
+    int limitblocks;            // Adaptive sizing upper bound (0 for maxblocks*4)
+} LcCacheConfig;
+
+// Cache counters (totals, per device or per owning file handle)
+typedef struct {
+    uint64_t hits;              // Lookups that found the block
+    uint64_t misses;            // Lookups that did not
+    uint64_t insertions;        // Blocks added to the cache
+    uint64_t evictions;         // Blocks the policy pushed out
+    uint64_t writebacks;        // Dirty blocks written to the device
+    uint64_t lines;             // Blocks resident now
+    uint64_t bytes;             // Bytes resident now
+    uint64_t zhits;             // Hits served from the compressed tier
+    uint64_t zlines;            // Blocks in the compressed tier (total only)
+    uint64_t zbytes;            // Compressed tier bytes in use (total only)
+    uint64_t l2hits;            // Hits served from the local disk cache
+    uint64_t l2lines;           // Blocks in the local disk cache (total only)
+    uint64_t capacity;          // Blocks the cache may hold now (total only)
+    uint64_t resizes;           // Adaptive capacity changes (total only)
+} LcCacheCounters;
+
+// Snapshot of the cache statistics
+typedef struct {
+    LcCacheCounters total;
+    LcCacheCounters device[LC_CACHE_MAXDEVICES];
+} LcCacheStats;
+
+// Writes a block to its device (used for write-through and dirty lines)
+typedef int (*LcCacheWriteback)(LcDeviceId did, uint16_t sec, uint16_t blk, char *block);
+
+//
+// Static Data
+
+/* C string labels for the policies */
+extern const char *LC_CACHE_POLICY_LABELS[LC_CACHE_MAXPOLICY];
 
 //
 // Functional Prototypes
 
 char * lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk );
-    // Search the cache for a block 
+    // Search the cache for a block (pointer only valid single-threaded)
+
+int lcloud_readcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+    // Copy a block out of the cache, safe with concurrent callers
+
+const char * lcloud_pincache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Pin a block and get a pointer to read it in place (NULL if not found)
+
+int lcloud_unpincache( const char *block );
+    // Release a block pinned with lcloud_pincache
 
 int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
     // Put a value in the cache 
 
+int lcloud_writecache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+    // Write a block through the cache (deferred in write-back mode)
+
+int lcloud_flushcache( void );
+    // Write every dirty line back to its device
+
+int lcloud_flushowner( uint32_t owner );
+    // Write the dirty lines of one file handle back to their devices
+
+int lcloud_dropcache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Forget a block the filesystem freed (dirty data is not written back)
+
+int lcloud_cache_setwriteback( LcCacheWriteback fn );
+    // Set the function used to write blocks to the devices
+
 int lcloud_initcache( int maxblocks );
     // Initialze the cache by setting up metadata a cache elements.
 
+int lcloud_initcache_sharded( int maxblocks, int nshards );
+    // Initialze the cache split into an explicit number of locked shards
+
+int lcloud_initcache_config( const LcCacheConfig *cfg );
+    // Initialze the cache from a configuration
+
+int lcloud_cacheconfig( LcCacheConfig *cfg, int maxblocks );
+    // Get the default configuration, with environment overrides applied
+
+LcCachePolicyType lcloud_cachepolicy( const char *name );
+    // Look up a replacement policy by name
+
+int lcloud_cache_setowner( uint32_t owner );
+    // Charge the calling thread's cache accesses to a file handle
+
+int lcloud_cache_openowner( uint32_t owner );
+    // Start tracking the lines and statistics of an opened file handle
+
+int lcloud_cache_closeowner( uint32_t owner );
+    // Stop tracking a closed file handle (its lines stay cached)
+
+int lcloud_cache_stats( LcCacheStats *stats );
+    // Get the cache statistics, in total and per device
+
+int lcloud_cache_filestats( uint32_t owner, LcCacheCounters *counters );
+    // Get the cache statistics of one file handle
+
 int lcloud_closecache( void );
-    // Clean up the cache when program is closing.
+    // Flush, save the snapshot (if configured) and clean up the cache.
 
 #endif
@@ -56,6 +56,19 @@ int socket_fd = -1;
 //
 // Functions
 
+// Read exactly len bytes from the server (TCP may split a response)
+static int clientReadFully(char *buffer, int len) {
+    int got = 0, r;
+    while (got < len) {
+        r = read(socket_fd, &buffer[got], len - got);
+        if (r <= 0) {
+            break;
+        }
+        got += r;
+    }
+    return (got);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : client_lcloud_bus_request
@@ -131,8 +144,8 @@ LCloudRegisterFrame client_lcloud_bus_request( LCloudRegisterFrame reg, void *bu
             memcpy(send_buffer, (char *)&net_reg, NET_REG_SIZE);
             write(socket_fd, send_buffer, NET_REG_SIZE);
 
-            // Receive reg and 1024 bytes of data from server
-            read_size = read(socket_fd, receive_buffer, 264);
+            // Receive reg and 256 bytes of data from server
+            read_size = clientReadFully(receive_buffer, NET_REG_SIZE + 256);
             memcpy(&response_reg, &receive_buffer[0], NET_REG_SIZE);
             memcpy(buf, &receive_buffer[NET_REG_SIZE], 256);
             response_reg = ntohll64(response_reg);
@@ -141,12 +154,11 @@ LCloudRegisterFrame client_lcloud_bus_request( LCloudRegisterFrame reg, void *bu
         case WRITE:
             // Send the reg following with data to server
             memcpy(send_buffer, (char *)&net_reg, NET_REG_SIZE);
-            write(socket_fd, send_buffer, NET_REG_SIZE);
             memcpy(&send_buffer[NET_REG_SIZE], buf, 256);
-            write(socket_fd, send_buffer, 256);
+            write(socket_fd, send_buffer, NET_REG_SIZE + 256);
 
             // Receiving only the reg from server
-            read_size = read(socket_fd, receive_buffer, 8);
+            read_size = clientReadFully(receive_buffer, NET_REG_SIZE);
             memcpy(&response_reg, &receive_buffer[0], NET_REG_SIZE);
             response_reg = ntohll64(response_reg);
             break;
@@ -158,7 +170,7 @@ LCloudRegisterFrame client_lcloud_bus_request( LCloudRegisterFrame reg, void *bu
 
 
             // Receive only the reg from server
-            read_size = read(socket_fd, receive_buffer, NET_REG_SIZE);
+            read_size = clientReadFully(receive_buffer, NET_REG_SIZE);
             memcpy(&response_reg, &receive_buffer[0], NET_REG_SIZE);
             response_reg = ntohll64(response_reg);
             break;
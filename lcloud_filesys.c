@@ -11,6 +11,7 @@
 // Include files
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
@@ -29,7 +30,7 @@
 #define REGISTER_MASK_D0 (uint64_t)0x00000000ffff0000
 #define REGISTER_MASK_D1 (uint64_t)0x000000000000ffff
 
-#define LCFHANDLE_MASK_ID 		 (uint32_t)0xff000000
+#define LCFHANDLE_MASK_GEN 		 (uint32_t)0x7f000000
 #define LCFHANDLE_MASK_HANDLE 	 (uint32_t)0x00ffffff
 
 #define SHIFT_BITS_B0 60
@@ -39,8 +40,59 @@
 #define SHIFT_BITS_C2 32
 #define SHIFT_BITS_D0 16
 #define SHIFT_BITS_D1 0
+
+#define SHIFT_BITS_GEN 24
+
+#define LC_BUS_FAILED (LCloudRegisterFrame)-1 // LCRequestFrame result of a failed request
+
+#define LC_STREAM_BLOCKS 8 // Blocks read in order before a handle is streaming
+#define LC_MAP_BLOCKS 16   // Initial entries of a file's block map
+#define LC_PATH_BUCKETS 64 // Initial buckets of the path index
+#define LC_HANDLE_SLOTS 64 // Initial slots of the handle table
+#define LC_DEVICE_FILES 64 // Initial entries of a device's file table
+#define LC_STRIPE_ENV "LCLOUD_STRIPE" // Blocks per device in a striped file, 0 for none
+#define LC_PLACEMENT_ENV "LCLOUD_PLACEMENT" // Device placement policy (see LC_PLACEMENT_LABELS)
+#define LC_BLOCK_PAYLOAD LC_DEVICE_BLOCK_SIZE // File bytes in a data block (no header)
+#define LC_LAYOUT_MAGIC 0x4d46434c // "LCFM", marks a file layout block
+#define LC_LAYOUT_VERSION 1 // On-device format of layout and data blocks
+#define LC_LAYOUT_EXTENTS 19 // Extents in a layout block after its header
+
+// Device placement policies for new files and for spilling to another device
+#define LC_PLACE_FIRST 0   // Lowest numbered device with room
+#define LC_PLACE_FREE 1    // Device with the most free blocks
+#define LC_PLACE_HASH 2    // Device picked by hashing the path
+#define LC_PLACE_LOAD 3    // Device with the fewest transfers so far
+#define LC_PLACE_MAX 4
 ////////////////////////////////////////////////////////////////////////////////
 
+typedef struct LcBlockAddr{
+
+    uint32_t device;                // Device, sector and block of a file block
+    uint32_t sector;
+    uint32_t block;
+
+} LcBlockAddr;
+
+// On-device layout of a file: a list of layout blocks, each a header and up
+// to LC_LAYOUT_EXTENTS extents of contiguous blocks, in file order
+typedef struct LcExtent{
+
+    uint32_t device;                // Device of the extent
+    uint32_t start;                 // First block (sector * blocks + block)
+    uint32_t count;                 // Blocks in the extent
+
+} LcExtent;
+
+typedef struct LcLayoutHeader{
+
+    uint32_t magic;                 // LC_LAYOUT_MAGIC
+    uint32_t version;               // LC_LAYOUT_VERSION
+    uint32_t length;                // File length
+    uint32_t extents;               // Extents in this layout block
+    LcBlockAddr next;               // Next layout block, all -1 if none
+
+} LcLayoutHeader;
+
 typedef struct LcFileInfo{
 
 	uint32_t filename;              // Integer file name 
@@ -53,18 +105,46 @@ typedef struct LcFileInfo{
     uint32_t currentLength;
     uint32_t start_sector;
     uint32_t start_block;
+    uint32_t start_device;
     char path[64];
+    uint32_t seqBlocks;             // Blocks read in order since the last out of order read
+    uint32_t seqNext;               // Offset just past the last read
+    uint32_t streamValid;           // The stream buffer holds a block
+    uint32_t streamDevice;          // Address of the block in the stream buffer
+    uint32_t streamSector;
+    uint32_t streamBlock;
+    char *streamData;               // Last block read while streaming (allocated on first use)
+    LcBlockAddr *blockMap;          // Logical block index -> device block (NULL while closed)
+    uint32_t mapBlocks;             // Blocks the file has (entries of blockMap filled in)
+    uint32_t mapSize;               // Entries blockMap can hold
+    struct LcFileInfo *pathNext;    // Next file in the same path index bucket
+    uint32_t tableIndex;            // Position in its device's fileInfoArray
+    uint32_t extentBlocks;          // Blocks reserved at open, kept on truncate
+    LcBlockAddr *layoutMap;         // Layout blocks holding the file's extents
+    uint32_t layoutBlocks;
+    uint32_t layoutDirty;           // Length or blocks changed since the layout was written
 
 } LcFileInfo;
 
+typedef struct LcHandleSlot{
+
+    LcFileInfo *fileInfo;           // File open on this slot, NULL if free
+    uint32_t generation;            // Changed each time the slot is freed
+    int32_t nextFree;               // Next free slot, -1 at the end
+
+} LcHandleSlot;
+
 typedef struct LcDeviceInfo{
 
     uint32_t deviceSectorsSize;
     uint32_t deviceBlocksSize;
     uint32_t deviceFilesSize;
     uint32_t currentCount;
-    uint32_t currentSector;
-    uint32_t currentBlock;
+    uint32_t fileInfoSize;          // Entries fileInfoArray can hold
+    uint64_t *freeMap;              // Bit per block, set if the block is in use
+    uint32_t freeBlocks;            // Blocks not in use
+    uint32_t freeHint;              // Block the next free block search starts at
+    uint64_t transfers;             // Block transfers sent to the device
     uint32_t isFull;
     LcFileInfo **fileInfoArray;
 
@@ -72,16 +152,26 @@ typedef struct LcDeviceInfo{
 
 LcDeviceInfo *deviceInfo[16];
 
-uint32_t fileHandleCount = 1;
-
-uint32_t hit = 0;
+LcFileInfo **pathIndex = NULL;      // Hash buckets of all files by path
+uint32_t pathIndexSize = 0;
+uint32_t pathIndexCount = 0;
 
-uint32_t miss = 0;
+LcHandleSlot *handleTable = NULL;   // Open files indexed by handle slot
+uint32_t handleTableSize = 0;
+int32_t handleFree = -1;            // First free slot, -1 if none
 
 uint32_t power_on = 0;
 
 uint32_t init = 0;
 
+uint32_t stripeBlocks = 0;          // Stripe unit of new blocks, 0 if not striping
+
+uint32_t placement = LC_PLACE_FIRST;
+
+const char *LC_PLACEMENT_LABELS[LC_PLACE_MAX] = {
+    "first", "free", "hash", "load"
+};
+
 LCloudRegisterFrame LCRequestFrame(LCloudRegisterFrame requestFrame, 
 	uint32_t operation, void *xfer);
 
@@ -92,11 +182,69 @@ LcFileInfo* GetFileInfoFromBuffer(char *buffer);
 
 int LCFileInfoToChar(LcFileInfo *fileInfo, char *buffer);
 
+int LCWriteBlock(LcDeviceId did, uint16_t sec, uint16_t blk, char *block);
+
+const char *LCPinBlock(uint32_t did, uint32_t sec, uint32_t blk, char *buffer);
+
+void LCReleaseBlock(const char *line, char *buffer);
+
+const char *LCStreamBlock(LcFileInfo *fileInfo, LcBlockAddr *addr, char *buffer);
+
+int LCMapSet(LcFileInfo *fileInfo, uint32_t index, uint32_t did, uint32_t sec, uint32_t blk);
+
+int LCMapGet(LcFileInfo *fileInfo, uint32_t index, LcBlockAddr *addr);
+
+void LCMapFree(LcFileInfo *fileInfo);
+
+uint32_t LCPathHash(const char *path);
+
+LcFileInfo *LCPathFind(const char *path);
+
+int LCPathInsert(LcFileInfo *fileInfo);
+
+LcFHandle LCHandleOpen(LcFileInfo *fileInfo);
+
+LcFileInfo *LCHandleFile(LcFHandle fh);
+
+void LCHandleClose(LcFHandle fh);
+
 LcDeviceInfo *GetNewLcDeviceInfo(uint32_t smallestDeviceID);
 
-int SetDevicePositionToNext(uint32_t deviceId);
+LcFileInfo *LCNewFileInfo(uint32_t deviceId);
+
+int LCAllocBlock(uint32_t deviceId, uint32_t *sector, uint32_t *block);
+
+int LCAllocRun(uint32_t deviceId, uint32_t nblocks, uint32_t *start);
 
-uint32_t GetNextDeviceId(uint32_t deviceId);
+int LCAllocFileBlock(LcFileInfo *fileInfo, uint32_t index, LcBlockAddr *addr);
+
+int LCAllocLayoutBlock(const char *path, uint32_t deviceId, LcBlockAddr *addr);
+
+void LCFreeBlock(uint32_t deviceId, uint32_t sector, uint32_t block);
+
+uint32_t LCFileBlocks(uint32_t length);
+
+uint32_t LCStripeDevice(LcFileInfo *fileInfo, uint32_t index);
+
+void LCSetPosition(LcFileInfo *fileInfo, uint32_t off);
+
+int LCReadAt(LcFileInfo *fileInfo, char *buf, uint32_t len, uint32_t off);
+
+int LCWriteAt(LcFileInfo *fileInfo, const char *buf, uint32_t len, uint32_t off);
+
+int LCSaveLayout(LcFileInfo *fileInfo);
+
+int LCLoadLayout(LcFileInfo *fileInfo);
+
+int LCValidRun(uint32_t deviceId, uint32_t start, uint32_t count);
+
+void LCPathRemove(LcFileInfo *fileInfo);
+
+void LCDropFile(LcFileInfo *fileInfo);
+
+void LCFreeReserved(uint32_t deviceId, uint32_t run, uint32_t start, uint32_t sector, uint32_t block);
+
+uint32_t LCPlaceDevice(const char *path, uint32_t exclude);
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -108,6 +256,23 @@ uint32_t GetNextDeviceId(uint32_t deviceId);
 
 LcFHandle lcopen( const char *path ) {
 
+	return( lcopen_ex(path, 0, 0) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcopen_ex
+// Description  : Open the file for for reading and writing. A new file opened
+//                with LC_OPEN_PREALLOC gets a contiguous run of blocks for
+//                the expected size, if a device has one.
+//
+// Inputs       : path - the path/filename of the file to be read
+//                size - the size the file is expected to grow to (0 if not known)
+//                flags - LC_OPEN_* flags
+// Outputs      : file handle if successful test, -1 if failure
+
+LcFHandle lcopen_ex( const char *path, size_t size, uint32_t flags ) {
+
 	LcFHandle lcFhandle = 0;
 	char test_block[LC_DEVICE_BLOCK_SIZE];
 	char filepath[64];
@@ -116,41 +281,79 @@ LcFHandle lcopen( const char *path ) {
 	memset (test_block, 0, sizeof (test_block));
 	LCloudRegisterFrame requestFrame = 0x0;
 	LCloudRegisterFrame respondFrame = 0x0;
+	LcCacheConfig cacheConfig;
 
 	if (!power_on){
 		respondFrame = LCRequestFrame(requestFrame, LC_POWER_ON, NULL);
-		if (respondFrame < 0) {
+		if (respondFrame == LC_BUS_FAILED) {
+			return(-1);
+		}
+
+		// Initialize the lcloud cache system; a warm start snapshot is only
+		// accepted for the same device set and LCLOUD_CACHE_STAMP generation
+		respondFrame = LCRequestFrame(requestFrame, LC_DEVPROBE, NULL);
+		if (respondFrame == LC_BUS_FAILED) {
+			return(-1);
+		}
+		lcloud_cache_setwriteback(LCWriteBlock);
+		const char *env = getenv(LC_STRIPE_ENV);
+		if (env != NULL && *env != '\0') {
+			stripeBlocks = CMPSC311_MAXVAL(atoi(env), 0);
+		}
+		if ((env = getenv(LC_PLACEMENT_ENV)) != NULL && *env != '\0') {
+			uint32_t p = 0;
+			while (p < LC_PLACE_MAX && strcasecmp(env, LC_PLACEMENT_LABELS[p]) != 0) {
+				p++;
+			}
+			if (p == LC_PLACE_MAX) {
+				char labels[64] = "";
+				for (p = 0; p < LC_PLACE_MAX; p++) {
+					strcat(labels, (p > 0) ? ", " : "");
+					strcat(labels, LC_PLACEMENT_LABELS[p]);
+				}
+				logMessage(LOG_ERROR_LEVEL, "Unknown device placement [%s=%s], expected one of: %s",
+					LC_PLACEMENT_ENV, env, labels);
+				return(-1);
+			}
+			placement = p;
+		}
+		// A bad cache option fails the open rather than running uncached;
+		// the next open retries the setup
+		if (lcloud_cacheconfig(&cacheConfig, 256)) {
+			return(-1);
+		}
+		cacheConfig.stamp ^= ((respondFrame & REGISTER_MASK_D0) >> SHIFT_BITS_D0) << 48;
+		if (lcloud_initcache_config(&cacheConfig)) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to initialize the cache, open of [%s] failed", filepath);
 			return(-1);
 		}
 		power_on = 1;
 	}
 
-	// Initialize the lcloud cache system
-	lcloud_initcache(256);
-	// Step 0: Search the DeviceInfoArray to check if the *path is in any of the devices
-    for (int i = 0; i < 16; i++) {
-        if (deviceInfo[i]) {
-            for (int j = 0; j < deviceInfo[i]->currentCount; j++) {
-                if (!strcmp(filepath, deviceInfo[i]->fileInfoArray[j]->path)) {
-                    if (deviceInfo[i]->fileInfoArray[j]->handle != 0) {
-                        return(-1);
-                    } else {
-                        deviceInfo[i]->fileInfoArray[j]->handle = fileHandleCount++;
-                        isFound = 1;
-                        lcFhandle = deviceInfo[i]->fileInfoArray[j]->handle;
-                        break;
-                    }
-                }
-            }
-        }
-    }
-    
+	// Step 0: Look the path up in the path index to see if the file exists
+	LcFileInfo *existing = LCPathFind(filepath);
+	if (existing != NULL) {
+		if (existing->handle != 0) {
+			return(-1);
+		}
+		// A closed file's block map is read back from its layout blocks
+		if (existing->blockMap == NULL && LCLoadLayout(existing)) {
+			return(-1);
+		}
+		lcFhandle = LCHandleOpen(existing);
+		if (lcFhandle < 0) {
+			return(-1);
+		}
+		existing->seqBlocks = 0;
+		existing->streamValid = 0;
+		isFound = 1;
+	}
 
 	// Step 1: Probe for the usable device
 	// If the file is not in the devices, we need to probe for the usable device
 	if (!isFound) {
 	    respondFrame = LCRequestFrame(requestFrame, LC_DEVPROBE, NULL);
-	    if (respondFrame < 0) {
+	    if (respondFrame == LC_BUS_FAILED) {
 	    	return(-1);
 	    }
 	    uint32_t deviceIDs = (respondFrame & REGISTER_MASK_D0) >> SHIFT_BITS_D0;
@@ -171,33 +374,105 @@ LcFHandle lcopen( const char *path ) {
 
 	    for (int i = 0; i < 16; i++) {
 	    	if ((deviceIDs >> i) & 1) {
-	    	    // Check whether device is not init or the device is not full
+	    	    // Check whether device is not init
 	    	    if (deviceInfo[i] == NULL) {
 	    	        // Init device info
                     deviceInfo[i] = GetNewLcDeviceInfo(i);
 	    	    } 
-	    	    // Add new file Info to the File Info array
-	    	    if (deviceInfo[i]->isFull == 0){
-                    deviceInfo[i]->fileInfoArray[deviceInfo[i]->currentCount] = malloc(sizeof(LcFileInfo ));
-                    deviceInfo[i]->fileInfoArray[deviceInfo[i]->currentCount]->handle = fileHandleCount++;
-                    deviceInfo[i]->fileInfoArray[deviceInfo[i]->currentCount]->sector_number = deviceInfo[i]->currentSector;
-                    deviceInfo[i]->fileInfoArray[deviceInfo[i]->currentCount]->block_number = deviceInfo[i]->currentBlock;
-                    deviceInfo[i]->fileInfoArray[deviceInfo[i]->currentCount]->start_sector = deviceInfo[i]->currentSector;
-                    deviceInfo[i]->fileInfoArray[deviceInfo[i]->currentCount]->start_block = deviceInfo[i]->currentBlock;
-                    deviceInfo[i]->fileInfoArray[deviceInfo[i]->currentCount]->device = i;
-                    strcpy(deviceInfo[i]->fileInfoArray[deviceInfo[i]->currentCount]->path, filepath);
-                    SetDevicePositionToNext(i);
-                    // Assign return handle
-                    lcFhandle = ((i << 24) & LCFHANDLE_MASK_ID) |
-                                (deviceInfo[i]->fileInfoArray[deviceInfo[i]->currentCount]->handle & LCFHANDLE_MASK_HANDLE);
-                    deviceInfo[i]->currentCount++;
-
-                    break;
-	    	    }
 	    	}
 	    }
+
+	    // Add new file Info to the File Info array of the device the
+	    // placement policy picks
+	    uint32_t i = LCPlaceDevice(filepath, 16);
+	    if (i >= 16) {
+	        logMessage(LOG_ERROR_LEVEL, "No device has room for new file [%s]", filepath);
+	        return(-1);
+	    }
+
+	    // Reserve the run of blocks for the size hint, on another device if
+	    // the placed one has no run that long; without one the file grows a
+	    // block at a time as usual
+	    uint32_t run = ((flags & LC_OPEN_PREALLOC) && size > 0) ? LCFileBlocks(size) : 0;
+	    uint32_t start = 0;
+	    if (run > 1 && LCAllocRun(i, run, &start)) {
+	        uint32_t d = 0;
+	        while (d < 16 && (d == i || deviceInfo[d] == NULL || LCAllocRun(d, run, &start))) {
+	            d++;
+	        }
+	        if (d < 16) {
+	            i = d;
+	        } else {
+	            run = 0;
+	        }
+	    }
+
+	    // Take the first data block and the first layout block before the
+	    // file is added, so a full device fails the open rather than the close
+	    uint32_t sector = 0, block = 0;
+	    uint32_t blocks = deviceInfo[i]->deviceBlocksSize;
+	    LcBlockAddr layout;
+	    if (run <= 1 && LCAllocBlock(i, &sector, &block)) {
+	        logMessage(LOG_ERROR_LEVEL, "No free blocks left on device %u for [%s]", i, filepath);
+	        return(-1);
+	    }
+	    if (LCAllocLayoutBlock(filepath, i, &layout)) {
+	        LCFreeReserved(i, run, start, sector, block);
+	        return(-1);
+	    }
+
+	    // From here a failure gives the blocks back and takes the file out
+	    // of the device's file table (and the path index) again
+	    LcFileInfo *fileInfo = LCNewFileInfo(i);
+	    if (fileInfo == NULL) {
+	        LCFreeReserved(i, run, start, sector, block);
+	        LCFreeBlock(layout.device, layout.sector, layout.block);
+	        return(-1);
+	    }
+	    strcpy(fileInfo->path, filepath);
+	    fileInfo->device = i;
+	    fileInfo->start_device = i;
+	    int failed = 0;
+	    fileInfo->layoutMap = malloc(sizeof(LcBlockAddr));
+	    if (fileInfo->layoutMap == NULL) {
+	        logMessage(LOG_ERROR_LEVEL, "Failed to allocate layout of [%s]", filepath);
+	        failed = 1;
+	    } else if (run > 1) {
+	        // Every block of the run goes in the block map up front
+	        for (uint32_t n = 0; n < run && !failed; n++) {
+	            failed = LCMapSet(fileInfo, n, i, (start + n) / blocks, (start + n) % blocks);
+	        }
+	        fileInfo->extentBlocks = run;
+	    } else {
+	        failed = LCMapSet(fileInfo, 0, i, sector, block);
+	    }
+	    if (!failed) {
+	        fileInfo->layoutMap[0] = layout;
+	        fileInfo->layoutBlocks = 1;
+	        fileInfo->layoutDirty = 1;
+	        fileInfo->sector_number = fileInfo->blockMap[0].sector;
+	        fileInfo->block_number = fileInfo->blockMap[0].block;
+	        fileInfo->start_sector = fileInfo->sector_number;
+	        fileInfo->start_block = fileInfo->block_number;
+	        failed = LCPathInsert(fileInfo);
+	    }
+	    // Assign return handle
+	    if (!failed) {
+	        lcFhandle = LCHandleOpen(fileInfo);
+	        failed = (lcFhandle < 0);
+	    }
+	    if (failed) {
+	        LCFreeReserved(i, run, start, sector, block);
+	        LCFreeBlock(layout.device, layout.sector, layout.block);
+	        LCDropFile(fileInfo);
+	        return(-1);
+	    }
 	}
 
+	// Track the handle's cache lines and statistics; the file still works
+	// untracked if the cache's owner table is full
+	lcloud_cache_openowner(lcFhandle);
+
 	return( lcFhandle ); 
 } 
 
@@ -212,164 +487,20 @@ LcFHandle lcopen( const char *path ) {
 // Outputs      : number of bytes read, -1 if failure
 int lcread( LcFHandle fh, char *buf, size_t len ) {
     //printf("\n---------------Inside file read\n");
-	// 1.1 Get the device ID and handle
-    uint32_t deviceId = fh >> 24;
-    uint32_t fileHandle = fh & LCFHANDLE_MASK_HANDLE;
-	char respondFileInfo[LC_DEVICE_BLOCK_SIZE];
-	uint32_t remFileLength = 0;
-	uint32_t remReadLength = (uint32_t) len;
-	uint32_t bufferPosition = 0;
-    LcFileInfo *fileInfo = NULL;
-	uint32_t isFound = 0;
-	uint32_t device, sector, block = 0;
-	memset(respondFileInfo, 0, LC_DEVICE_BLOCK_SIZE);
-	// Request file info from the device and check if the file is openning
-	LCloudRegisterFrame requestFrame = 0x0;
-	LCloudRegisterFrame respondFrame = 0x0;
-
-	//memset(buf, '\0', strlen(buf));
+    lcloud_cache_setowner(fh);
 
-	// If the file is currently in any of the devices, get it
-
-	for (int i = 0; i < deviceInfo[deviceId]->currentCount; i++) {
-	    if (deviceInfo[deviceId]->fileInfoArray[i]->handle == fileHandle && fileHandle != 0) {
-            fileInfo = deviceInfo[deviceId]->fileInfoArray[i];
-            isFound = 1;
-            break;
-	    }
-	}
-    deviceId = fileInfo->device;
-
-
-	if (!fileInfo || !fileInfo->handle || !isFound) {
+	// Get the open file from the handle table
+	LcFileInfo *fileInfo = LCHandleFile(fh);
+	if (fileInfo == NULL) {
 		return (-1);
 	}
 
-	// Calculate and update the remaining bytes of the current file
-	remFileLength = fileInfo->length - fileInfo->currentLength;
-	memset(respondFileInfo, 0, LC_DEVICE_BLOCK_SIZE);
-	uint32_t writeBytes = 0;
-
-	if (fileInfo->offset > 0){
-        //printf("--------------Inside read if\n");
-		if (remReadLength >= LC_DEVICE_BLOCK_SIZE - fileInfo->offset - 12) {
-			writeBytes = LC_DEVICE_BLOCK_SIZE - fileInfo->offset - 12;
-		}
-		else {
-			writeBytes = remReadLength;
-		}
-
-		char *value = lcloud_getcache(fileInfo->device, fileInfo->sector_number, fileInfo->block_number);
-
-		// If the data is found in the cache system, return data, otherwise add it to the cache
-		if (value != NULL){
-		    // Update fileInfo (old_sector, old_block) -> (new_sector, new_block)
-            memcpy(&respondFileInfo[0], &value[0], LC_DEVICE_BLOCK_SIZE);
-            //printf("%s\n", &respondFileInfo[12]);
-
-            hit ++;
-		} else {
-		    miss ++;
-            // 2.1 Read the first block from the device
-            requestFrame = LCRequestFramePackaging(fileInfo->device, LC_XFER_READ,
-                                                   fileInfo->sector_number, fileInfo->block_number);
-            respondFrame = LCRequestFrame(requestFrame, LC_BLOCK_XFER, respondFileInfo);
-            if (respondFrame < 0) {
-                return (-1);
-            }
-
-            lcloud_putcache(fileInfo->device, fileInfo->sector_number, fileInfo->block_number, &respondFileInfo[0]);
-        }
-
-		// Get the next sector & block the file points to from the block header
-        
-        memcpy(&device, &respondFileInfo[0], 4);
-		memcpy(&sector, &respondFileInfo[4], 4);
-		memcpy(&block, &respondFileInfo[8], 4);
-		memcpy(&buf[0], &respondFileInfo[fileInfo->offset + 12], writeBytes);
-		if (sector != -1 && block != -1 && remReadLength >= LC_DEVICE_BLOCK_SIZE - fileInfo->offset - 12) {
-            fileInfo->device = device;
-		    fileInfo->block_number = block;
-		    fileInfo->sector_number = sector;
-		}
-
-		// Update the file info
-		bufferPosition += writeBytes;
-		remFileLength -= writeBytes;
-		fileInfo->currentLength += writeBytes;
-
-		// If (!endOfFile)
-		if (writeBytes == LC_DEVICE_BLOCK_SIZE - fileInfo->offset - 12){
-		    fileInfo->offset = 0;
-		    remReadLength -= writeBytes;
-		} else {
-		    fileInfo->offset += writeBytes;
-		    remReadLength -= writeBytes;
-		}
-
+	// Read at the file position and move it past the data read
+	int bufferPosition = LCReadAt(fileInfo, buf, (uint32_t) len, fileInfo->currentLength);
+	if (bufferPosition < 0) {
+		return (-1);
 	}
-
-	// 2.2 Read the remaining file blocks
-	while (remReadLength > 0 && remFileLength > 0) {
-		//printf("\n----------------------while\n");
-        // If the remaining bytes is larger than 256 and the there still
-        // have more than 256 bytes to read, transfer a whole block
-        memset(respondFileInfo, 0, LC_DEVICE_BLOCK_SIZE);
-        char *value = lcloud_getcache(fileInfo->device, fileInfo->sector_number, fileInfo->block_number);
-
-        // If the read block is in the cache, return the cache line.
-        if (value != NULL) {
-            hit ++;
-            memcpy(&respondFileInfo[0], &value[0], LC_DEVICE_BLOCK_SIZE);
-
-        } else {
-            miss ++;
-            // Send request to the storage system, add cache line to the cache system
-            requestFrame = LCRequestFramePackaging(fileInfo->device, LC_XFER_READ,
-                                                   fileInfo->sector_number, fileInfo->block_number);
-            respondFrame = LCRequestFrame(requestFrame, LC_BLOCK_XFER, &respondFileInfo[0]);
-            if (respondFrame < 0) {
-                return (-1);
-            }
-
-            lcloud_putcache(fileInfo->device, fileInfo->sector_number, fileInfo->block_number, &respondFileInfo[0]);
-        }
-
-        if (remFileLength >= LC_DEVICE_BLOCK_SIZE - 12 && remReadLength >= LC_DEVICE_BLOCK_SIZE - 12) {
-
-            memcpy(&device, &respondFileInfo[0], 4);
-            memcpy(&sector, &respondFileInfo[4], 4);
-            memcpy(&block, &respondFileInfo[8], 4);
-            
-            if (sector != -1 && block != -1) {
-                fileInfo->device = device;
-                fileInfo->block_number = block;
-                fileInfo->sector_number = sector;
-            }
-
-
-            memcpy(&buf[bufferPosition], &respondFileInfo[12], LC_DEVICE_BLOCK_SIZE - 12);
-
-            bufferPosition += LC_DEVICE_BLOCK_SIZE - 12;
-            remFileLength -= LC_DEVICE_BLOCK_SIZE - 12;
-            remReadLength -= LC_DEVICE_BLOCK_SIZE - 12;
-            fileInfo->currentLength += LC_DEVICE_BLOCK_SIZE - 12;
-
-            // Reset the offset to the beginning of the next block
-            fileInfo->offset = 0;
-
-        } else if (remFileLength >= remReadLength) {
-
-            memcpy(&buf[bufferPosition], &respondFileInfo[12], remReadLength);
-            bufferPosition += remReadLength;
-            fileInfo->offset += remReadLength;
-            fileInfo->currentLength += remReadLength;
-
-            break;
-        } else {
-            return (-1);
-        }
-    }	
+	LCSetPosition(fileInfo, fileInfo->currentLength + bufferPosition);
 
     buf[bufferPosition] = '\0';
 
@@ -387,315 +518,139 @@ int lcread( LcFHandle fh, char *buf, size_t len ) {
 int lcwrite( LcFHandle fh, char *buf, size_t len ) {
 
     //printf("\n-------Begin write\n");
-    uint32_t deviceId = fh >> 24;
-    uint32_t fileHandle = fh & LCFHANDLE_MASK_HANDLE;
-	char respondFileInfo[LC_DEVICE_BLOCK_SIZE];
-	uint32_t remWriteLength = (uint32_t) len;
-	int32_t remFileLength = 0;
-	uint32_t bufferPosition = 0;
-	uint32_t device, sector, block = 0;
-    uint32_t endOfFile = 0;
-    uint32_t overwrite = 0;
-    uint32_t old_device = 0;
-	memset(respondFileInfo, 0, LC_DEVICE_BLOCK_SIZE);
-
-	// Request file info from the device and check if the file is openning
-	LCloudRegisterFrame requestFrame = 0x0;
-	LCloudRegisterFrame respondFrame = 0x0;
-
-	LcFileInfo *fileInfo = NULL;
-
-	uint32_t isFound = 0;
-    // If the file is currently in any of the devices, get it
-    for (int i = 0; i < deviceInfo[deviceId]->currentCount; i++) {
-        if (deviceInfo[deviceId]->fileInfoArray[i]->handle == fileHandle && fileHandle != 0) {
-            fileInfo = deviceInfo[deviceId]->fileInfoArray[i];
-            isFound = 1;
-            break;
-        }
-    }
-    //printf("deviceId: %d\n", deviceId);
+    lcloud_cache_setowner(fh);
 
-    if (!fileInfo || !fileInfo->handle || !isFound) {
+    // Get the open file from the handle table
+	LcFileInfo *fileInfo = LCHandleFile(fh);
+    if (fileInfo == NULL) {
         return (-1);
     }
 
-	memset(respondFileInfo, 0, LC_DEVICE_BLOCK_SIZE);
-	remFileLength = fileInfo->length - fileInfo->currentLength;
-
-    // 2.1 Write the first block to the device
-    // Case 1: offset > 0
-
-    
-	uint32_t writeBytes = 0;
-	if (fileInfo->offset > 0){
-        //printf("\n----------Inside if\n");
-		if (remWriteLength >= LC_DEVICE_BLOCK_SIZE - fileInfo->offset - 12){
-			writeBytes = LC_DEVICE_BLOCK_SIZE - fileInfo->offset - 12;
-        } else {
-            endOfFile = 1;
-			writeBytes = remWriteLength;
-		}
-
-        old_device = fileInfo->device;
-		char *value = lcloud_getcache(fileInfo->device, fileInfo->sector_number, fileInfo->block_number);
-		if (value != NULL) {
-            hit ++;
-            memcpy(&respondFileInfo[0], &value[0], LC_DEVICE_BLOCK_SIZE);
-        } else {
-            miss ++;
-            // Send request to the storage system, add cache line to the cache system
-            requestFrame = LCRequestFramePackaging(fileInfo->device, LC_XFER_READ,
-                                                   fileInfo->sector_number, fileInfo->block_number);
-            respondFrame = LCRequestFrame(requestFrame, LC_BLOCK_XFER, &respondFileInfo[0]);
-            if (respondFrame < 0) {
-                return (-1);
-            }
-
-            lcloud_putcache(fileInfo->device, fileInfo->sector_number, fileInfo->block_number, &respondFileInfo[0]);
-        }
-        // Read from the next block to see if the header is not -1
-        //requestFrame = LCRequestFramePackaging(deviceId, LC_XFER_READ,
-                                               //fileInfo->sector_number, fileInfo->block_number);
-        //respondFrame = LCRequestFrame(requestFrame, LC_BLOCK_XFER, respondFileInfo);
-        if (respondFrame < 0) {
-            return(-1);
-        }
-        memcpy(&device, &respondFileInfo[0], 4);
-        memcpy(&sector, &respondFileInfo[4], 4);
-        memcpy(&block, &respondFileInfo[8], 4);
-        //printf("------------device: %d, sector: %d, block: %d\n", device, sector, block);
+	// Write at the file position and move it past the data written
+	int bufferPosition = LCWriteAt(fileInfo, buf, (uint32_t) len, fileInfo->currentLength);
+	if (bufferPosition < 0) {
+		return (-1);
+	}
+	LCSetPosition(fileInfo, fileInfo->currentLength + bufferPosition);
 
-        if ((int)sector > 0 || (int)block > 0) {
-        	overwrite = 1;
-        }
+	return( bufferPosition );
+}
 
-        //printf("endOfFile: %d, overwrite: %d\n", endOfFile, overwrite);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcpread
+// Description  : Read data from the file at an offset, leaving the file
+//                position where it is
+//
+// Inputs       : fh - file handle for the file to read from
+//                buf - place to put the data
+//                len - the length of the read
+//                off - offset within the file to read from
+// Outputs      : number of bytes read, -1 if failure
 
-        // Set the block header -> (sector, block)
-        if (endOfFile && !overwrite) {
-            device = -1;
-        	sector = -1;
-            block = -1;
-        }
-        else {
-        	if (overwrite == 0 && ((sector == 0 && block == 0) || (sector <= -1 && block <= -1) ||
-                     sector > deviceInfo[fileInfo->device]->deviceSectorsSize ||
-                     block > deviceInfo[fileInfo->device]->deviceBlocksSize)) {
-
-                // If the current device is full, put the rest of file data to next avaible device
-                if ((deviceInfo[fileInfo->device]->currentSector == deviceInfo[fileInfo->device]->deviceSectorsSize - 1 &&
-                        deviceInfo[fileInfo->device]->currentBlock >= deviceInfo[fileInfo->device]->deviceBlocksSize - 1) || 
-                        deviceInfo[fileInfo->device]->isFull) {
-
-                    deviceInfo[fileInfo->device]->isFull = 1;
-                    device = GetNextDeviceId(fileInfo->device);
-                    fileInfo->device = device;
-                }
-                device = fileInfo->device;
-        		sector = deviceInfo[fileInfo->device]->currentSector;
-            	block = deviceInfo[fileInfo->device]->currentBlock;
-            	SetDevicePositionToNext(fileInfo->device);
-        	}
-        }
-        //printf("deviceInfo[fileInfo->device]->deviceBlocksSize: %d", deviceInfo[fileInfo->device]->deviceBlocksSize);
-        // Write to the current block that the file info points to
-        
-        memcpy(&respondFileInfo[0], (char *)&device, 4);
-        memcpy(&respondFileInfo[4], (char *)&sector, 4);
-        memcpy(&respondFileInfo[8], (char *)&block, 4);
-        memcpy(&respondFileInfo[fileInfo->offset + 12], &buf[0], writeBytes);
-
-		
-        requestFrame = LCRequestFramePackaging(old_device, LC_XFER_WRITE, 
-			fileInfo->sector_number, fileInfo->block_number);
-		respondFrame = LCRequestFrame(requestFrame, LC_BLOCK_XFER, &respondFileInfo[0]);
-        //if (fileInfo->offset + writeBytes != 244) {
-            lcloud_putcache(old_device, fileInfo->sector_number, fileInfo->block_number, &respondFileInfo[0]);
-        //printf("%s\n", &respondFileInfo[12]);
-        //} else {
-        //    printf("Reach me!!\n");
-        //    lcloud_putcache(device, sector, block, &respondFileInfo[0]);
-        //}
-		
-		
-		// Update the file info
-		bufferPosition += writeBytes;
-		remWriteLength -= writeBytes;
+int lcpread( LcFHandle fh, char *buf, size_t len, size_t off ) {
 
-		// If the block is full, point to the next block or sector
+    lcloud_cache_setowner(fh);
+    LcFileInfo *fileInfo = LCHandleFile(fh);
+    if (fileInfo == NULL || off > fileInfo->length) {
+        return (-1);
+    }
+    return (LCReadAt(fileInfo, buf, (uint32_t) len, (uint32_t) off));
+}
 
-		if (!endOfFile) {
-            fileInfo->device = device;
-		    fileInfo->sector_number = sector;
-		    fileInfo->block_number = block;
-            fileInfo->offset = 0;
-		} else {
-            fileInfo->offset += writeBytes;
-		}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcpwrite
+// Description  : Write data to the file at an offset, leaving the file
+//                position where it is
+//
+// Inputs       : fh - file handle for the file to write to
+//                buf - pointer to data to write
+//                len - the length of the write
+//                off - offset within the file to write at (at most its length)
+// Outputs      : number of bytes written if successful test, -1 if failure
 
-		// Check if the write operation is complete
-		if (writeBytes > remFileLength) {
-			fileInfo->length += writeBytes - remFileLength;
-			fileInfo->currentLength += writeBytes - remFileLength;
-		}
-		else {
-		    fileInfo->currentLength += writeBytes;
-			remFileLength -= writeBytes;
-		}
-		overwrite = 0;
-        old_device = 0;
-	}
+int lcpwrite( LcFHandle fh, char *buf, size_t len, size_t off ) {
 
-	// Begin writing whole blocks
-	// 2.2 Read the remaining file blocks
-    endOfFile = 0;
-	while (remWriteLength > 0) {
-        //printf("\n----------------Inside while\n");
-        //printf("------------- did: %d, sec: %d  blk: %d\n", fileInfo->device, fileInfo->sector_number, fileInfo->block_number);
-		// If the remaining bytes is larger than 256 and the there still 
-		// have more than 256 bytes to read, transfer a whole block
-		if (remWriteLength > LC_DEVICE_BLOCK_SIZE - 12){
-			writeBytes = LC_DEVICE_BLOCK_SIZE - 12;
-		}
-		else {
-            writeBytes = remWriteLength;
-            endOfFile = 1;
-		}
-
-        old_device = fileInfo->device;
-		// Read from the next block to see if the header is not -1
-        char *value = lcloud_getcache(fileInfo->device, fileInfo->sector_number, fileInfo->block_number);
-		if (value != NULL) {
-            hit ++;
-            memcpy(&respondFileInfo[0], &value[0], LC_DEVICE_BLOCK_SIZE);
-        } else {
-            miss ++;
-            // Send request to the storage system, add cache line to the cache system
-            requestFrame = LCRequestFramePackaging(fileInfo->device, LC_XFER_READ,
-                                                   fileInfo->sector_number, fileInfo->block_number);
-            respondFrame = LCRequestFrame(requestFrame, LC_BLOCK_XFER, &respondFileInfo[0]);
-            if (respondFrame < 0) {
-                return (-1);
-            }
+    lcloud_cache_setowner(fh);
+    LcFileInfo *fileInfo = LCHandleFile(fh);
+    if (fileInfo == NULL || off > fileInfo->length) {
+        return (-1);
+    }
+    return (LCWriteAt(fileInfo, buf, (uint32_t) len, (uint32_t) off));
+}
 
-            lcloud_putcache(fileInfo->device, fileInfo->sector_number, fileInfo->block_number, &respondFileInfo[0]);
-        }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcreadv
+// Description  : Read several ranges of the file in one call, leaving the
+//                file position where it is. Reading stops at the first range
+//                that reaches the end of the file.
+//
+// Inputs       : fh - file handle for the file to read from
+//                iov - the ranges to read (buffer, length and file offset)
+//                iovcnt - the number of ranges
+// Outputs      : total number of bytes read, -1 if failure
 
-        memcpy(&device, &respondFileInfo[0], 4);
-        memcpy(&sector, &respondFileInfo[4], 4);
-        memcpy(&block, &respondFileInfo[8], 4);
-        //printf("------------device: %d, sector: %d, block: %d\n", device, sector, block);
-        //printf("endOfFile: %d, overwrite: %d\n", endOfFile, overwrite);
+int lcreadv( LcFHandle fh, const LcIoVec *iov, int iovcnt ) {
 
-        if ((int)sector > 0 || (int)block > 0) {
-            overwrite = 1;
+    lcloud_cache_setowner(fh);
+    LcFileInfo *fileInfo = LCHandleFile(fh);
+    if (fileInfo == NULL || iovcnt < 0) {
+        return (-1);
+    }
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].off > fileInfo->length) {
+            return (-1);
         }
-
-        // Set the block header -> (sector, block)
-        // If write mode is turned to override, the file is not reach the end
-        //printf("fileInfo->device: %d\n", fileInfo->device);
-        //printf("fileInfo->sector: %d\n", fileInfo->sector_number);
-        //printf("fileInfo->block: %d\n", fileInfo->block_number);
-        //printf("device: %d, sector: %d, block: %d\n", device, sector, block);
-
-        if (endOfFile && !overwrite) {
-            device = -1;
-        	sector = -1;
-            block = -1;
+        int done = LCReadAt(fileInfo, iov[i].buf, (uint32_t) iov[i].len, (uint32_t) iov[i].off);
+        if (done < 0) {
+            return (-1);
         }
-        else {
-        	if (overwrite == 0 && ((sector == 0 && block == 0) || (sector <= -1 && block <= -1) ||
-                     sector > deviceInfo[fileInfo->device]->deviceSectorsSize ||
-                     block > deviceInfo[fileInfo->device]->deviceBlocksSize)) {
-        		
-                // If the current device is full, put the rest of file data to next avaible device
-                if ((deviceInfo[fileInfo->device]->currentSector == deviceInfo[fileInfo->device]->deviceSectorsSize - 1 &&
-                        deviceInfo[fileInfo->device]->currentBlock >= deviceInfo[fileInfo->device]->deviceBlocksSize - 1) ||
-                        deviceInfo[fileInfo->device]->isFull) {
-                    
-                    deviceInfo[fileInfo->device]->isFull = 1;
-                    device = GetNextDeviceId(fileInfo->device);
-                    fileInfo->device = device;
-                }
-                device = fileInfo->device;
-                sector = deviceInfo[fileInfo->device]->currentSector;
-                block = deviceInfo[fileInfo->device]->currentBlock;
-                SetDevicePositionToNext(fileInfo->device);
-            }
-            	
+        total += done;
+        if ((size_t)done < iov[i].len) {
+            break;
         }
+    }
+    return (total);
+}
 
-		// Write to the current block that the file info points to
-		
-        memcpy(&respondFileInfo[0], (char *)&device, 4);
-        memcpy(&respondFileInfo[4], (char *)&sector, 4);
-        memcpy(&respondFileInfo[8], (char *)&block, 4);
-        memcpy(&respondFileInfo[12], &buf[bufferPosition], writeBytes);
-        //printf("New device: %d, sector: %d, block: %d\n", device, sector, block);
-        //printf("---------------offset: %d\n", fileInfo->offset);
-
-		requestFrame = LCRequestFramePackaging(old_device, LC_XFER_WRITE, 
-			fileInfo->sector_number, fileInfo->block_number);
-		respondFrame = LCRequestFrame(requestFrame, LC_BLOCK_XFER, respondFileInfo);
-		//if (fileInfo->offset + writeBytes != 244) {
-            lcloud_putcache(old_device, fileInfo->sector_number, fileInfo->block_number, &respondFileInfo[0]);
-            //printf("%s\n", &respondFileInfo[12]);
-        //} else {
-        //    printf("Reach me!!\n");
-        //    lcloud_putcache(device, sector, block, &respondFileInfo[0]);
-        //}
-        //printf("%s\n", &respondFileInfo[12]);
-
-        
-
-		if (respondFrame < 0) {
-			return(-1);
-		}
-
-		bufferPosition += writeBytes;
-		if (writeBytes > remFileLength) {
-			fileInfo->length += writeBytes - remFileLength;
-			fileInfo->currentLength = fileInfo->length;
-			remFileLength = 0;
-		}
-		else {
-		    fileInfo->currentLength += writeBytes;
-			remFileLength -= writeBytes;
-		}
-		//remFileLength -= writeBytes;
-		remWriteLength -= writeBytes;
-		
-		// Update the file position (sector_num, block_num)
-		if (!endOfFile){
-            /*if (fileInfo->offset == 244) {
-                requestFrame = LCRequestFramePackaging(old_device, LC_XFER_WRITE, 
-                    sector, block);
-                respondFrame = LCRequestFrame(requestFrame, LC_BLOCK_XFER, respondFileInfo);
-                lcloud_putcache(old_device, fileInfo->sector_number, fileInfo->block_number, &respondFileInfo[0]);
-            }*/
-            fileInfo->device = device;
-		    fileInfo->sector_number = sector;
-		    fileInfo->block_number = block;
-			fileInfo->offset = 0;
-		}
-		else {
-			fileInfo->offset += writeBytes;
-		}
-		// If the remReadLength is greater than remFileLength, function failed
-
-        endOfFile = 0;
-        overwrite = 0;
-        old_device = 0;
-
-	}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcwritev
+// Description  : Write several ranges of the file in one call, in order,
+//                leaving the file position where it is
+//
+// Inputs       : fh - file handle for the file to write to
+//                iov - the ranges to write (buffer, length and file offset,
+//                      at most the file length once the earlier ranges are in)
+//                iovcnt - the number of ranges
+// Outputs      : total number of bytes written (up to the first range written
+//                short) if successful test, -1 if failure
 
-	if (remFileLength < 0) {
-		fileInfo->length -= remFileLength;
-		fileInfo->currentLength = fileInfo->length;
-	}
+int lcwritev( LcFHandle fh, const LcIoVec *iov, int iovcnt ) {
 
-	return( bufferPosition );
+    lcloud_cache_setowner(fh);
+    LcFileInfo *fileInfo = LCHandleFile(fh);
+    if (fileInfo == NULL || iovcnt < 0) {
+        return (-1);
+    }
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].off > fileInfo->length) {
+            return (-1);
+        }
+        int done = LCWriteAt(fileInfo, iov[i].buf, (uint32_t) iov[i].len, (uint32_t) iov[i].off);
+        if (done < 0) {
+            return ((total > 0) ? total : -1);
+        }
+        total += done;
+        if ((size_t)done < iov[i].len) {
+            break;
+        }
+    }
+    return (total);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -709,110 +664,20 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
 
 int lcseek( LcFHandle fh, size_t off ) {
 	
-    uint32_t deviceId = fh >> 24;
-    uint32_t fileHandle = fh & LCFHANDLE_MASK_HANDLE;
-	uint32_t sector, block, device = 0;
-	char respondFileInfo[LC_DEVICE_BLOCK_SIZE];
-	int remLength = (int) off;
-	memset(respondFileInfo, 0, LC_DEVICE_BLOCK_SIZE);
-    LcFileInfo *fileInfo = NULL;
-    uint32_t isFound = 0;
-
-    // If the file is currently in any of the devices, get it
-    for (int i = 0; i < deviceInfo[deviceId]->currentCount; i++) {
-        if (deviceInfo[deviceId]->fileInfoArray[i]->handle == fileHandle && fileHandle != 0) {
-            fileInfo = deviceInfo[deviceId]->fileInfoArray[i];
-            isFound = 1;
-            break;
-        }
-    }
+    lcloud_cache_setowner(fh);
 
-    if (!fileInfo || !fileInfo->handle || !isFound) {
+    // Get the open file from the handle table
+    LcFileInfo *fileInfo = LCHandleFile(fh);
+    if (fileInfo == NULL) {
         return (-1);
     }
 	
-    if (fileInfo->length < remLength) {
+    if (fileInfo->length < off) {
         return (-1);
     }
 
-    // Request file info from the device and check if the file is openning
-	LCloudRegisterFrame requestFrame = 0;
-	LCloudRegisterFrame respondFrame = 0;
-
-    device = deviceId;
-	sector = fileInfo->start_sector;
-	block = fileInfo->start_block;
-
-	// Reset the file offset
-	if (off <= LC_DEVICE_BLOCK_SIZE - 12) {
-		fileInfo->sector_number = fileInfo->start_sector;
-		fileInfo->block_number = fileInfo->start_block;
-        fileInfo->device = deviceId;
-		fileInfo->offset = off;
-		fileInfo->currentLength = off;
-    	return(off);
-    }
-
-
-    fileInfo->currentLength = 0;
-    
-    uint32_t old_device = 0;
-	uint32_t old_sector = 0;
-	uint32_t old_block = 0;
-
-	while (remLength > 0) {
-
-	    char *value = lcloud_getcache(device, sector, block);
-		if (value != NULL) {
-            hit ++;
-            memcpy(&respondFileInfo[0], &value[0], LC_DEVICE_BLOCK_SIZE);
-        } else {
-            miss ++;
-            // Send request to the storage system, add cache line to the cache system
-            requestFrame = LCRequestFramePackaging(device, LC_XFER_READ,
-                                                   sector, block);
-            respondFrame = LCRequestFrame(requestFrame, LC_BLOCK_XFER, &respondFileInfo[0]);
-            if (respondFrame < 0) {
-                return (-1);
-            }
-
-            lcloud_putcache(device, sector, block, &respondFileInfo[0]);
-        }
-        old_device = device;
-        old_sector = sector;
-        old_block = block;
-
-
-		if (remLength < LC_DEVICE_BLOCK_SIZE - 12) {
-            fileInfo->device = device;
-            fileInfo->sector_number = sector;
-            fileInfo->block_number = block;
-            fileInfo->offset = remLength;
-            fileInfo->currentLength += remLength;
-            return (off);
-        }
-
-		remLength -= LC_DEVICE_BLOCK_SIZE - 12;
-		fileInfo->currentLength += LC_DEVICE_BLOCK_SIZE - 12;
-        //Update the new (sector, block) pointer
-        memcpy(&device, &respondFileInfo[0], 4);
-        memcpy(&sector, &respondFileInfo[4], 4);
-        memcpy(&block, &respondFileInfo[8], 4);
-        if ((sector == -1 && block == -1)) {
-            device = old_device;
-            sector = old_sector;
-            block = old_block;
-        }
-        
-	}
-
-	if (remLength == 0) {
-        fileInfo->device = device;
-		fileInfo->sector_number = sector;
-        fileInfo->block_number = block;
-        fileInfo->offset = 0;
-        fileInfo->currentLength += remLength;
-	}
+    // Jump straight to the block holding the offset through the block map
+    LCSetPosition(fileInfo, off);
 	return (off);
 
 }
@@ -827,70 +692,212 @@ int lcseek( LcFHandle fh, size_t off ) {
 
 int lcclose( LcFHandle fh ) {
 
-	uint32_t deviceId = fh >> 24;
-	uint32_t fileHandle = fh & LCFHANDLE_MASK_HANDLE;
-    LcFileInfo *fileInfo = NULL;
-    uint32_t isFound = 0;
-
-	// Request file info from the device and check if the file is openning
-    //printf("Before close\n");
-    for (int i = 0; i < deviceInfo[deviceId]->currentCount; i++) {
-        if (deviceInfo[deviceId]->fileInfoArray[i]->handle == fileHandle && fileHandle != 0) {
-            fileInfo = deviceInfo[deviceId]->fileInfoArray[i];
-            fileInfo->handle = 0;
-            isFound = 1;
-            break;
-        }
+    lcloud_cache_setowner(fh);
+
+	// Check the file is open
+    LcFileInfo *fileInfo = LCHandleFile(fh);
+    if (fileInfo == NULL) {
+        return (-1);
     }
 
-    if (!isFound) {
+    // Write the layout if it changed; the block map is read back from it
+    // when the file is opened again. Then push the file's dirty blocks out
+    // so the devices hold it. The file stays open if either fails.
+    if (fileInfo->layoutDirty && LCSaveLayout(fileInfo)) {
+        return (-1);
+    }
+    if (lcloud_flushowner(fh)) {
         return (-1);
     }
 
+    // Free its handle, stream buffer and block map
+    LCHandleClose(fh);
+    free(fileInfo->streamData);
+    fileInfo->streamData = NULL;
+    fileInfo->streamValid = 0;
+    LCMapFree(fileInfo);
+    lcloud_cache_closeowner(fh);
+
 	return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcshutdown
-// Description  : Shut down the filesystem
+// Function     : lctruncate
+// Description  : Shorten a file, giving the blocks past its new end back to
+//                their devices
 //
-// Inputs       : none
+// Inputs       : fh - the file handle of the file to truncate
+//                len - the new length of the file
 // Outputs      : 0 if successful test, -1 if failure
 
-int lcshutdown( void ) {
+int lctruncate( LcFHandle fh, size_t len ) {
 
-	LCloudRegisterFrame requestFrame = 0x0;
-	LCloudRegisterFrame respondFrame = LCRequestFrame(requestFrame, LC_DEVPROBE, NULL);
-	if (respondFrame < 0) {
-		return(-1);
+    lcloud_cache_setowner(fh);
+    LcFileInfo *fileInfo = LCHandleFile(fh);
+    if (fileInfo == NULL || len > fileInfo->length) {
+        return (-1);
+    }
+
+    // Free the blocks past the new end; the reserved run stays with the
+    // file for when it grows again
+    uint32_t keep = CMPSC311_MAXVAL(LCFileBlocks(len), fileInfo->extentBlocks);
+    for (uint32_t i = keep; i < fileInfo->mapBlocks; i++) {
+        LCFreeBlock(fileInfo->blockMap[i].device, fileInfo->blockMap[i].sector, fileInfo->blockMap[i].block);
+    }
+    fileInfo->mapBlocks = CMPSC311_MINVAL(fileInfo->mapBlocks, keep);
+    fileInfo->length = len;
+    fileInfo->layoutDirty = 1;
+    fileInfo->streamValid = 0;
+
+    // A position past the new end moves back to it
+    if (fileInfo->currentLength > len) {
+        LCSetPosition(fileInfo, len);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcunlink
+// Description  : Delete a file that is not open, giving its blocks back to
+//                their devices
+//
+// Inputs       : path - the path/filename of the file to delete
+// Outputs      : 0 if successful test, -1 if failure
+
+int lcunlink( const char *path ) {
+
+    LcFileInfo *fileInfo = LCPathFind(path);
+    if (fileInfo == NULL || fileInfo->handle != 0) {
+        return (-1);
+    }
+
+    // Free every block of the file and its layout blocks
+    if (fileInfo->blockMap == NULL && LCLoadLayout(fileInfo)) {
+        return (-1);
+    }
+    for (uint32_t i = 0; i < fileInfo->mapBlocks; i++) {
+        LCFreeBlock(fileInfo->blockMap[i].device, fileInfo->blockMap[i].sector, fileInfo->blockMap[i].block);
+    }
+    for (uint32_t i = 0; i < fileInfo->layoutBlocks; i++) {
+        LCFreeBlock(fileInfo->layoutMap[i].device, fileInfo->layoutMap[i].sector, fileInfo->layoutMap[i].block);
+    }
+
+    // Drop the file from the path index and its device's file table
+    LCDropFile(fileInfo);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcfreeblocks
+// Description  : Count the blocks free on the devices (for new files, file
+//                growth and layouts)
+//
+// Inputs       : none
+// Outputs      : the number of free blocks, -1 if the devices are not probed yet
+
+long lcfreeblocks( void ) {
+
+    long total = 0;
+    if (!init) {
+        return (-1);
+    }
+    for (int i = 0; i < 16; i++) {
+        if (deviceInfo[i] != NULL) {
+            total += deviceInfo[i]->freeBlocks;
+        }
+    }
+    return (total);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcshutdown
+// Description  : Shut down the filesystem
+//
+// Inputs       : none
+// Outputs      : 0 if successful test, -1 if failure
+
+int lcshutdown( void ) {
+
+	LCloudRegisterFrame requestFrame = 0x0;
+	LCloudRegisterFrame respondFrame = 0x0;
+	LcCacheStats stats;
+	int ret = 0;
+
+	// Write the layout of the files still open, then the dirty blocks, while
+	// the devices are still powered. A failure is reported once the rest
+	// is written and the devices are off.
+	for (int i = 0; i < 16; i++) {
+		for (uint32_t j = 0; deviceInfo[i] != NULL && j < deviceInfo[i]->currentCount; j++) {
+			if (deviceInfo[i]->fileInfoArray[j]->layoutDirty && LCSaveLayout(deviceInfo[i]->fileInfoArray[j])) {
+				ret = -1;
+			}
+		}
+	}
+	if (lcloud_flushcache()) {
+		ret = -1;
 	}
 
-	// Closing all the files
-	uint32_t deviceIDs = respondFrame & REGISTER_MASK_D0 >> SHIFT_BITS_D0;
+	// Closing all the files on every device that was set up
 	for (int i = 0; i < 16; i++) {
-		if ((deviceIDs >> i) & 1) {
+		if (deviceInfo[i] != NULL) {
             for (int j = 0; j < deviceInfo[i]->currentCount; j++) {
                 deviceInfo[i]->fileInfoArray[j]->handle = 0;
+                free(deviceInfo[i]->fileInfoArray[j]->blockMap);
+                free(deviceInfo[i]->fileInfoArray[j]->layoutMap);
+                free(deviceInfo[i]->fileInfoArray[j]->streamData);
                 free(deviceInfo[i]->fileInfoArray[j]);
             }
             free(deviceInfo[i]->fileInfoArray);
+            free(deviceInfo[i]->freeMap);
             free(deviceInfo[i]);
+            deviceInfo[i] = NULL;
 		}
 
 	}
+	init = 0;
+
+	free(handleTable);
+	handleTable = NULL;
+	handleTableSize = 0;
+	handleFree = -1;
+	free(pathIndex);
+	pathIndex = NULL;
+	pathIndexSize = 0;
+	pathIndexCount = 0;
 
 	requestFrame = 0x0;
     respondFrame = LCRequestFrame(requestFrame, LC_POWER_OFF, NULL);
-	if (respondFrame < 0) {
-		return (-1);
+	if (respondFrame == LC_BUS_FAILED) {
+		ret = -1;
+	}
+	power_on = 0;
+
+	// Report the cache effectiveness for the run
+	if (lcloud_cache_stats(&stats) == 0) {
+		logMessage(LOG_INFO_LEVEL, "Cache: %lu hits, %lu misses, %lu insertions, %lu evictions, %lu writebacks",
+			(unsigned long)stats.total.hits, (unsigned long)stats.total.misses,
+			(unsigned long)stats.total.insertions, (unsigned long)stats.total.evictions,
+			(unsigned long)stats.total.writebacks);
+		if (stats.total.zlines > 0 || stats.total.zhits > 0) {
+			logMessage(LOG_INFO_LEVEL, "Cache: %lu compressed hits, %lu compressed blocks in %lu bytes",
+				(unsigned long)stats.total.zhits, (unsigned long)stats.total.zlines,
+				(unsigned long)stats.total.zbytes);
+		}
+		if (stats.total.l2lines > 0 || stats.total.l2hits > 0) {
+			logMessage(LOG_INFO_LEVEL, "Cache: %lu local disk hits, %lu blocks on local disk",
+				(unsigned long)stats.total.l2hits, (unsigned long)stats.total.l2lines);
+		}
+		if (stats.total.resizes > 0) {
+			logMessage(LOG_INFO_LEVEL, "Cache: resized %lu times, capacity now %lu blocks",
+				(unsigned long)stats.total.resizes, (unsigned long)stats.total.capacity);
+		}
 	}
-
-	printf("The number of cache hit: %d\n", hit);
-	printf("The number of cache miss: %d\n", miss);
-	printf("The hit / miss rate is: %f\n", (double)(hit / (double)(miss + hit)));
     lcloud_closecache();
-	return( 0 );
+	return( ret );
 }
 
 // Copy the fileInfo to the given buffer
@@ -915,11 +922,17 @@ LCloudRegisterFrame LCRequestFrame(LCloudRegisterFrame requestFrame,
 	uint32_t operation, void *xfer) {
 
 	requestFrame = requestFrame | ((uint64_t)operation << SHIFT_BITS_C0);
+	if (operation == LC_BLOCK_XFER) {
+		uint32_t did = (requestFrame & REGISTER_MASK_C1) >> SHIFT_BITS_C1;
+		if (did < 16 && deviceInfo[did] != NULL) {
+			deviceInfo[did]->transfers++;
+		}
+	}
 	LCloudRegisterFrame respondFrame = client_lcloud_bus_request(requestFrame, xfer);
     //printf("---------Succ on io cloud bus\n");
 	// Respond failed
 	if ((respondFrame & REGISTER_MASK_B1) >> SHIFT_BITS_B1 != LC_SUCCESS) {
-		return (-1);
+		return (LC_BUS_FAILED);
 	}		
 	return (respondFrame);
 }
@@ -934,6 +947,556 @@ LCloudRegisterFrame LCRequestFramePackaging(uint32_t c1,
 	return (requestFrame);
 }
 
+// Write one block to a device over the bus (cache writeback function)
+int LCWriteBlock(LcDeviceId did, uint16_t sec, uint16_t blk, char *block) {
+
+	LCloudRegisterFrame requestFrame = LCRequestFramePackaging(did, LC_XFER_WRITE, sec, blk);
+	if (LCRequestFrame(requestFrame, LC_BLOCK_XFER, block) == LC_BUS_FAILED) {
+		logMessage(LOG_ERROR_LEVEL, "Block write failed [did=%d, sec=%d, blk=%d]", did, sec, blk);
+		return (-1);
+	}
+	return (0);
+}
+
+// Get a block to read in place: the pinned cache line on a hit, otherwise the
+// block is read from the device into buffer (and cached). NULL on failure.
+const char *LCPinBlock(uint32_t did, uint32_t sec, uint32_t blk, char *buffer) {
+
+	const char *line = lcloud_pincache(did, sec, blk);
+	if (line != NULL) {
+		return (line);
+	}
+	LCloudRegisterFrame requestFrame = LCRequestFramePackaging(did, LC_XFER_READ, sec, blk);
+	if (LCRequestFrame(requestFrame, LC_BLOCK_XFER, buffer) == LC_BUS_FAILED) {
+		return (NULL);
+	}
+	lcloud_putcache(did, sec, blk, buffer);
+	return (buffer);
+}
+
+// Get a block of a file for lcread. Once the handle has read
+// LC_STREAM_BLOCKS blocks in order it is streaming: cache hits are still
+// used, but misses are read into the handle's stream buffer (so the rest of
+// a partly read block is still at hand) and not put in the cache, where
+// they would push out blocks that get reused. A read out of order ends the
+// stream.
+const char *LCStreamBlock(LcFileInfo *fileInfo, LcBlockAddr *addr, char *buffer) {
+
+	uint32_t did = addr->device, sec = addr->sector, blk = addr->block;
+	if (fileInfo->seqBlocks < LC_STREAM_BLOCKS) {
+		return (LCPinBlock(did, sec, blk, buffer));
+	}
+	if (fileInfo->streamValid && fileInfo->streamDevice == did &&
+	    fileInfo->streamSector == sec && fileInfo->streamBlock == blk) {
+		memcpy(buffer, fileInfo->streamData, LC_DEVICE_BLOCK_SIZE);
+		return (buffer);
+	}
+	const char *line = lcloud_pincache(did, sec, blk);
+	if (line != NULL) {
+		return (line);
+	}
+	LCloudRegisterFrame requestFrame = LCRequestFramePackaging(did, LC_XFER_READ, sec, blk);
+	if (LCRequestFrame(requestFrame, LC_BLOCK_XFER, buffer) == LC_BUS_FAILED) {
+		return (NULL);
+	}
+	if (fileInfo->streamData == NULL && (fileInfo->streamData = malloc(LC_DEVICE_BLOCK_SIZE)) == NULL) {
+		return (buffer);
+	}
+	memcpy(fileInfo->streamData, buffer, LC_DEVICE_BLOCK_SIZE);
+	fileInfo->streamDevice = did;
+	fileInfo->streamSector = sec;
+	fileInfo->streamBlock = blk;
+	fileInfo->streamValid = 1;
+	return (buffer);
+}
+
+// Release a block from LCPinBlock (unpins it if it came from the cache)
+void LCReleaseBlock(const char *line, char *buffer) {
+
+	if (line != buffer) {
+		lcloud_unpincache(line);
+	}
+}
+
+// Record where a file's logical block lives in its block map. Only the next
+// unfilled entry (or one already filled) can be set, so the map never has
+// holes. -1 on failure.
+int LCMapSet(LcFileInfo *fileInfo, uint32_t index, uint32_t did, uint32_t sec, uint32_t blk) {
+
+	if (index > fileInfo->mapBlocks) {
+		logMessage(LOG_ERROR_LEVEL, "Block %u of [%s] set before block %u", index, fileInfo->path, fileInfo->mapBlocks);
+		return (-1);
+	}
+	if (index == fileInfo->mapSize) {
+		uint32_t size = (fileInfo->mapSize == 0) ? LC_MAP_BLOCKS : fileInfo->mapSize * 2;
+		LcBlockAddr *map = realloc(fileInfo->blockMap, size * sizeof(LcBlockAddr));
+		if (map == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to grow block map of [%s] to %u blocks", fileInfo->path, size);
+			return (-1);
+		}
+		fileInfo->blockMap = map;
+		fileInfo->mapSize = size;
+	}
+	fileInfo->blockMap[index].device = did;
+	fileInfo->blockMap[index].sector = sec;
+	fileInfo->blockMap[index].block = blk;
+	if (index == fileInfo->mapBlocks) {
+		fileInfo->mapBlocks++;
+	}
+	return (0);
+}
+
+// Get the address of a file's logical block from its block map. 0 if found,
+// 1 if the file has no block there yet.
+int LCMapGet(LcFileInfo *fileInfo, uint32_t index, LcBlockAddr *addr) {
+
+	if (index >= fileInfo->mapBlocks) {
+		return (1);
+	}
+	*addr = fileInfo->blockMap[index];
+	return (0);
+}
+
+// Free a file's block map; it is read back from the layout when needed
+void LCMapFree(LcFileInfo *fileInfo) {
+
+	free(fileInfo->blockMap);
+	fileInfo->blockMap = NULL;
+	fileInfo->mapBlocks = 0;
+	fileInfo->mapSize = 0;
+}
+
+// Number of blocks holding a file's data (the start block is always there)
+uint32_t LCFileBlocks(uint32_t length) {
+
+	return ((length == 0) ? 1 : (length + LC_BLOCK_PAYLOAD - 1) / LC_BLOCK_PAYLOAD);
+}
+
+// Move a file's position to an offset, pointing it at the block holding the
+// offset if the file has one there yet
+void LCSetPosition(LcFileInfo *fileInfo, uint32_t off) {
+
+	LcBlockAddr addr;
+	if (LCMapGet(fileInfo, off / LC_BLOCK_PAYLOAD, &addr) == 0) {
+		fileInfo->device = addr.device;
+		fileInfo->sector_number = addr.sector;
+		fileInfo->block_number = addr.block;
+	}
+	fileInfo->offset = off % LC_BLOCK_PAYLOAD;
+	fileInfo->currentLength = off;
+}
+
+// Read from a file at an offset, no further than its end. Reads that go on
+// from where the last one stopped count towards streaming (LCStreamBlock).
+// Number of bytes read, -1 on failure.
+int LCReadAt(LcFileInfo *fileInfo, char *buf, uint32_t len, uint32_t off) {
+
+	char respondFileInfo[LC_DEVICE_BLOCK_SIZE];
+	uint32_t remReadLength = 0;
+	uint32_t bufferPosition = 0;
+	const char *line = NULL;
+	LcBlockAddr addr;
+
+	if (off != fileInfo->seqNext) {
+		fileInfo->seqBlocks = 0;
+	}
+	if (off < fileInfo->length) {
+		remReadLength = CMPSC311_MINVAL(len, fileInfo->length - off);
+	}
+
+	// Copy the data block by block, finding each block in the block map
+	while (remReadLength > 0) {
+		uint32_t offset = off % LC_BLOCK_PAYLOAD;
+		uint32_t readBytes = CMPSC311_MINVAL(LC_BLOCK_PAYLOAD - offset, remReadLength);
+		if (LCMapGet(fileInfo, off / LC_BLOCK_PAYLOAD, &addr) != 0) {
+			return (-1);
+		}
+
+		// Read the block in place from the cache line, or from the device on a miss
+		line = LCStreamBlock(fileInfo, &addr, respondFileInfo);
+		if (line == NULL) {
+			return (-1);
+		}
+		memcpy(&buf[bufferPosition], &line[offset], readBytes);
+		LCReleaseBlock(line, respondFileInfo);
+		if (offset + readBytes == LC_BLOCK_PAYLOAD) {
+			fileInfo->seqBlocks++;
+		}
+
+		bufferPosition += readBytes;
+		remReadLength -= readBytes;
+		off += readBytes;
+	}
+	fileInfo->seqNext = off;
+	return (bufferPosition);
+}
+
+// Write to a file at an offset no further than its end, giving it new
+// blocks as it grows past its last one. Number of bytes written (short if
+// a block write fails partway), -1 on failure.
+int LCWriteAt(LcFileInfo *fileInfo, const char *buf, uint32_t len, uint32_t off) {
+
+	char respondFileInfo[LC_DEVICE_BLOCK_SIZE];
+	uint32_t remWriteLength = len;
+	uint32_t bufferPosition = 0;
+	const char *line = NULL;
+	LcBlockAddr addr;
+
+	// The stream buffer may hold a block this write changes
+	fileInfo->streamValid = 0;
+
+	while (remWriteLength > 0) {
+		uint32_t index = off / LC_BLOCK_PAYLOAD;
+		uint32_t offset = off % LC_BLOCK_PAYLOAD;
+		uint32_t writeBytes = CMPSC311_MINVAL(LC_BLOCK_PAYLOAD - offset, remWriteLength);
+
+		// The file gets a new block when it grows past its last one
+		if (LCMapGet(fileInfo, index, &addr) != 0) {
+			if (LCAllocFileBlock(fileInfo, index, &addr)) {
+				break;
+			}
+			if (LCMapSet(fileInfo, index, addr.device, addr.sector, addr.block)) {
+				LCFreeBlock(addr.device, addr.sector, addr.block);
+				break;
+			}
+			fileInfo->layoutDirty = 1;
+		}
+
+		// The block is only read when the write keeps some of its file data
+		uint32_t blockStart = index * LC_BLOCK_PAYLOAD;
+		uint32_t validBytes = (fileInfo->length > blockStart) ?
+			CMPSC311_MINVAL(fileInfo->length - blockStart, LC_BLOCK_PAYLOAD) : 0;
+		if (offset > 0 || offset + writeBytes < validBytes) {
+			line = LCPinBlock(addr.device, addr.sector, addr.block, respondFileInfo);
+			if (line == NULL) {
+				break;
+			}
+			if (line != respondFileInfo) {
+				memcpy(respondFileInfo, line, LC_DEVICE_BLOCK_SIZE);
+				LCReleaseBlock(line, respondFileInfo);
+			}
+		} else {
+			memset(respondFileInfo, 0, LC_DEVICE_BLOCK_SIZE);
+		}
+		memcpy(&respondFileInfo[offset], &buf[bufferPosition], writeBytes);
+
+		// Write through the cache (deferred until eviction in write-back mode)
+		if (lcloud_writecache(addr.device, addr.sector, addr.block, &respondFileInfo[0])) {
+			break;
+		}
+
+		bufferPosition += writeBytes;
+		remWriteLength -= writeBytes;
+		off += writeBytes;
+		if (off > fileInfo->length) {
+			fileInfo->length = off;
+			fileInfo->layoutDirty = 1;
+		}
+	}
+
+	// A write that fails partway counts the blocks written before it (the
+	// length only grew by those); -1 if none were
+	if (remWriteLength > 0 && bufferPosition == 0) {
+		return (-1);
+	}
+	return (bufferPosition);
+}
+
+// Write a file's length and block map, as extents of contiguous blocks, to
+// its layout blocks. Layout blocks are taken (on the file's first device if
+// it has room) or given back as the extent list grows or shrinks. -1 on
+// failure.
+int LCSaveLayout(LcFileInfo *fileInfo) {
+
+	char buffer[LC_DEVICE_BLOCK_SIZE];
+	LcLayoutHeader header;
+	uint32_t nextents = 0;
+	LcExtent *extents = malloc(CMPSC311_MAXVAL(fileInfo->mapBlocks, 1) * sizeof(LcExtent));
+	if (extents == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to allocate extent list of [%s]", fileInfo->path);
+		return (-1);
+	}
+	for (uint32_t i = 0; i < fileInfo->mapBlocks; i++) {
+		LcBlockAddr *addr = &fileInfo->blockMap[i];
+		uint32_t start = addr->sector * deviceInfo[addr->device]->deviceBlocksSize + addr->block;
+		if (nextents > 0 && extents[nextents - 1].device == addr->device &&
+		    extents[nextents - 1].start + extents[nextents - 1].count == start) {
+			extents[nextents - 1].count++;
+		} else {
+			extents[nextents].device = addr->device;
+			extents[nextents].start = start;
+			extents[nextents].count = 1;
+			nextents++;
+		}
+	}
+
+	// Take or give back layout blocks to fit the extents
+	uint32_t nlayout = CMPSC311_MAXVAL((nextents + LC_LAYOUT_EXTENTS - 1) / LC_LAYOUT_EXTENTS, 1);
+	if (nlayout > fileInfo->layoutBlocks) {
+		LcBlockAddr *map = realloc(fileInfo->layoutMap, nlayout * sizeof(LcBlockAddr));
+		if (map == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to grow layout of [%s] to %u blocks", fileInfo->path, nlayout);
+			free(extents);
+			return (-1);
+		}
+		fileInfo->layoutMap = map;
+	}
+	while (fileInfo->layoutBlocks < nlayout) {
+		if (LCAllocLayoutBlock(fileInfo->path, fileInfo->start_device,
+		                       &fileInfo->layoutMap[fileInfo->layoutBlocks])) {
+			free(extents);
+			return (-1);
+		}
+		fileInfo->layoutBlocks++;
+	}
+	while (fileInfo->layoutBlocks > nlayout) {
+		LcBlockAddr *addr = &fileInfo->layoutMap[--fileInfo->layoutBlocks];
+		LCFreeBlock(addr->device, addr->sector, addr->block);
+	}
+
+	// Fill each layout block with its header and share of the extents
+	for (uint32_t n = 0; n < nlayout; n++) {
+		LcBlockAddr *addr = &fileInfo->layoutMap[n];
+		memset(buffer, 0, LC_DEVICE_BLOCK_SIZE);
+		header.magic = LC_LAYOUT_MAGIC;
+		header.version = LC_LAYOUT_VERSION;
+		header.length = fileInfo->length;
+		header.extents = CMPSC311_MINVAL(nextents - n * LC_LAYOUT_EXTENTS, LC_LAYOUT_EXTENTS);
+		if (n + 1 < nlayout) {
+			header.next = fileInfo->layoutMap[n + 1];
+		} else {
+			memset(&header.next, 0xff, sizeof(header.next));
+		}
+		memcpy(buffer, &header, sizeof(header));
+		memcpy(&buffer[sizeof(header)], &extents[n * LC_LAYOUT_EXTENTS], header.extents * sizeof(LcExtent));
+		if (lcloud_writecache(addr->device, addr->sector, addr->block, buffer)) {
+			free(extents);
+			return (-1);
+		}
+	}
+	free(extents);
+	fileInfo->layoutDirty = 0;
+	return (0);
+}
+
+// Read a closed file's length and block map back from its layout blocks,
+// following the next link of each from the first. -1 on failure, or if a
+// layout block is not one this format version wrote or points outside the
+// devices; the block map is left freed then.
+int LCLoadLayout(LcFileInfo *fileInfo) {
+
+	char buffer[LC_DEVICE_BLOCK_SIZE];
+	LcLayoutHeader header;
+	LcExtent extent;
+	if (fileInfo->layoutBlocks == 0) {
+		logMessage(LOG_ERROR_LEVEL, "File [%s] has no layout to read", fileInfo->path);
+		return (-1);
+	}
+	LcBlockAddr addr = fileInfo->layoutMap[0];
+	uint32_t nlayout = 0;
+	fileInfo->mapBlocks = 0;
+	while (addr.device != (uint32_t)-1) {
+
+		// The chain can be no longer than the layout blocks the file holds
+		if (++nlayout > fileInfo->layoutBlocks || addr.device >= 16 || deviceInfo[addr.device] == NULL ||
+		    addr.sector >= deviceInfo[addr.device]->deviceSectorsSize ||
+		    addr.block >= deviceInfo[addr.device]->deviceBlocksSize) {
+			logMessage(LOG_ERROR_LEVEL, "Bad layout link of [%s] [did=%u, sec=%u, blk=%u]",
+			           fileInfo->path, addr.device, addr.sector, addr.block);
+			LCMapFree(fileInfo);
+			return (-1);
+		}
+		const char *line = LCPinBlock(addr.device, addr.sector, addr.block, buffer);
+		if (line == NULL) {
+			LCMapFree(fileInfo);
+			return (-1);
+		}
+		memcpy(&header, line, sizeof(header));
+		if (header.magic != LC_LAYOUT_MAGIC || header.version != LC_LAYOUT_VERSION ||
+		    header.extents > LC_LAYOUT_EXTENTS) {
+			LCReleaseBlock(line, buffer);
+			logMessage(LOG_ERROR_LEVEL, "Bad layout block of [%s] [did=%u, sec=%u, blk=%u]",
+			           fileInfo->path, addr.device, addr.sector, addr.block);
+			LCMapFree(fileInfo);
+			return (-1);
+		}
+		for (uint32_t e = 0; e < header.extents; e++) {
+			memcpy(&extent, &line[sizeof(header) + e * sizeof(LcExtent)], sizeof(extent));
+			if (!LCValidRun(extent.device, extent.start, extent.count)) {
+				LCReleaseBlock(line, buffer);
+				logMessage(LOG_ERROR_LEVEL, "Layout of [%s] has a bad extent [did=%u, start=%u, count=%u]",
+				           fileInfo->path, extent.device, extent.start, extent.count);
+				LCMapFree(fileInfo);
+				return (-1);
+			}
+			uint32_t blocks = deviceInfo[extent.device]->deviceBlocksSize;
+			for (uint32_t k = 0; k < extent.count; k++) {
+				if (LCMapSet(fileInfo, fileInfo->mapBlocks, extent.device,
+				             (extent.start + k) / blocks, (extent.start + k) % blocks)) {
+					LCReleaseBlock(line, buffer);
+					LCMapFree(fileInfo);
+					return (-1);
+				}
+			}
+		}
+		LCReleaseBlock(line, buffer);
+		fileInfo->length = header.length;
+		addr = header.next;
+	}
+	return (0);
+}
+
+// Check a run of blocks (numbered sector * blocks + block) is on a device
+// that is present and inside it. 1 if it is.
+int LCValidRun(uint32_t deviceId, uint32_t start, uint32_t count) {
+
+	if (deviceId >= 16 || deviceInfo[deviceId] == NULL || count == 0) {
+		return (0);
+	}
+	uint32_t total = deviceInfo[deviceId]->deviceSectorsSize * deviceInfo[deviceId]->deviceBlocksSize;
+	return (start < total && count <= total - start);
+}
+
+// Hash a path for the path index (FNV-1a)
+uint32_t LCPathHash(const char *path) {
+
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < 64 && path[i] != '\0'; i++) {
+		hash = (hash ^ (uint8_t)path[i]) * 16777619u;
+	}
+	return (hash);
+}
+
+// Find a file by path in the path index, NULL if there is none
+LcFileInfo *LCPathFind(const char *path) {
+
+	if (pathIndexSize == 0) {
+		return (NULL);
+	}
+	LcFileInfo *fileInfo = pathIndex[LCPathHash(path) & (pathIndexSize - 1)];
+	while (fileInfo != NULL && strncmp(fileInfo->path, path, 64) != 0) {
+		fileInfo = fileInfo->pathNext;
+	}
+	return (fileInfo);
+}
+
+// Add a new file to the path index, doubling the buckets when it gets full
+int LCPathInsert(LcFileInfo *fileInfo) {
+
+	if (pathIndexCount >= pathIndexSize) {
+		uint32_t size = (pathIndexSize == 0) ? LC_PATH_BUCKETS : pathIndexSize * 2;
+		LcFileInfo **buckets = calloc(size, sizeof(LcFileInfo *));
+		if (buckets == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to grow path index to %u buckets", size);
+			return (-1);
+		}
+		for (uint32_t i = 0; i < pathIndexSize; i++) {
+			while (pathIndex[i] != NULL) {
+				LcFileInfo *moved = pathIndex[i];
+				pathIndex[i] = moved->pathNext;
+				uint32_t bucket = LCPathHash(moved->path) & (size - 1);
+				moved->pathNext = buckets[bucket];
+				buckets[bucket] = moved;
+			}
+		}
+		free(pathIndex);
+		pathIndex = buckets;
+		pathIndexSize = size;
+	}
+	uint32_t bucket = LCPathHash(fileInfo->path) & (pathIndexSize - 1);
+	fileInfo->pathNext = pathIndex[bucket];
+	pathIndex[bucket] = fileInfo;
+	pathIndexCount++;
+	return (0);
+}
+
+// Take a file out of the path index
+void LCPathRemove(LcFileInfo *fileInfo) {
+
+	if (pathIndexSize == 0) {
+		return;
+	}
+	LcFileInfo **link = &pathIndex[LCPathHash(fileInfo->path) & (pathIndexSize - 1)];
+	while (*link != NULL && *link != fileInfo) {
+		link = &(*link)->pathNext;
+	}
+	if (*link != NULL) {
+		*link = fileInfo->pathNext;
+		pathIndexCount--;
+	}
+}
+
+// Drop a file from the path index (if it is there) and its device's file
+// table, and free it; its blocks must already be given back
+void LCDropFile(LcFileInfo *fileInfo) {
+
+	LCPathRemove(fileInfo);
+	LcDeviceInfo *info = deviceInfo[fileInfo->start_device];
+	LcFileInfo *last = info->fileInfoArray[--info->currentCount];
+	info->fileInfoArray[fileInfo->tableIndex] = last;
+	last->tableIndex = fileInfo->tableIndex;
+
+	free(fileInfo->blockMap);
+	free(fileInfo->layoutMap);
+	free(fileInfo->streamData);
+	free(fileInfo);
+}
+
+// Open a handle on a file: take a free slot of the handle table (growing it
+// when there is none) and tag it with the slot's generation. -1 on failure.
+LcFHandle LCHandleOpen(LcFileInfo *fileInfo) {
+
+	if (handleFree < 0) {
+		uint32_t size = (handleTableSize == 0) ? LC_HANDLE_SLOTS : handleTableSize * 2;
+		if (size > LCFHANDLE_MASK_HANDLE + 1) {
+			logMessage(LOG_ERROR_LEVEL, "Too many open files, handle table is full");
+			return (-1);
+		}
+		LcHandleSlot *table = realloc(handleTable, size * sizeof(LcHandleSlot));
+		if (table == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to grow handle table to %u slots", size);
+			return (-1);
+		}
+		for (uint32_t i = handleTableSize; i < size; i++) {
+			table[i].fileInfo = NULL;
+			table[i].generation = 1;
+			table[i].nextFree = (i + 1 < size) ? (int32_t)(i + 1) : handleFree;
+		}
+		handleFree = handleTableSize;
+		handleTable = table;
+		handleTableSize = size;
+	}
+	uint32_t slot = handleFree;
+	handleFree = handleTable[slot].nextFree;
+	handleTable[slot].fileInfo = fileInfo;
+	fileInfo->handle = (handleTable[slot].generation << SHIFT_BITS_GEN) | slot;
+	return ((LcFHandle)fileInfo->handle);
+}
+
+// Get the file open on a handle, NULL if the handle is not open (or is a
+// stale handle of a slot that has been reused)
+LcFileInfo *LCHandleFile(LcFHandle fh) {
+
+	uint32_t slot = (uint32_t)fh & LCFHANDLE_MASK_HANDLE;
+	uint32_t generation = ((uint32_t)fh & LCFHANDLE_MASK_GEN) >> SHIFT_BITS_GEN;
+	if (fh < 0 || slot >= handleTableSize || handleTable[slot].fileInfo == NULL ||
+	    handleTable[slot].generation != generation) {
+		return (NULL);
+	}
+	return (handleTable[slot].fileInfo);
+}
+
+// Close a handle: free its slot and move the slot to a new generation
+void LCHandleClose(LcFHandle fh) {
+
+	uint32_t slot = (uint32_t)fh & LCFHANDLE_MASK_HANDLE;
+	handleTable[slot].fileInfo->handle = 0;
+	handleTable[slot].fileInfo = NULL;
+	handleTable[slot].generation = (handleTable[slot].generation % (LCFHANDLE_MASK_GEN >> SHIFT_BITS_GEN)) + 1;
+	handleTable[slot].nextFree = handleFree;
+	handleFree = slot;
+}
+
 // Get file info directly from buffer
 LcFileInfo* GetFileInfoFromBuffer(char *buffer) {
 
@@ -953,48 +1516,243 @@ LcDeviceInfo *GetNewLcDeviceInfo(uint32_t smallestDeviceID) {
 
     LcDeviceInfo *info;
     info = malloc(sizeof(LcDeviceInfo ));
+    if (info == NULL) {
+        return(NULL);
+    }
     LCloudRegisterFrame requestFrame = LCRequestFramePackaging(smallestDeviceID, 0, 0, 0);
     LCloudRegisterFrame respondFrame = LCRequestFrame(requestFrame, LC_DEVINIT, NULL);
-    if (respondFrame < 0) {
+    if (respondFrame == LC_BUS_FAILED) {
         return(NULL);
     }
     info->deviceSectorsSize = (respondFrame & REGISTER_MASK_D0) >> SHIFT_BITS_D0;
     info->deviceBlocksSize = (respondFrame & REGISTER_MASK_D1) >> SHIFT_BITS_D1;
     info->deviceFilesSize = (info->deviceSectorsSize * info->deviceBlocksSize) / 50;
     info->currentCount = 0;
-    info->currentBlock = 1;
-    info->currentSector = 0;
     info->isFull = 0;
-    info->fileInfoArray = (LcFileInfo **)malloc(300 * sizeof(LcFileInfo *));
+    info->fileInfoArray = NULL;
+    info->fileInfoSize = 0;
+
+    // Every block starts free, except past the end of the last bitmap word
+    uint32_t nblocks = info->deviceSectorsSize * info->deviceBlocksSize;
+    info->freeMap = calloc((nblocks + 63) / 64, sizeof(uint64_t));
+    if (info->freeMap == NULL || nblocks == 0) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to set up free block map of device %u", smallestDeviceID);
+        free(info->freeMap);
+        free(info);
+        return(NULL);
+    }
+    if (nblocks % 64) {
+        info->freeMap[nblocks / 64] = ~(((uint64_t)1 << (nblocks % 64)) - 1);
+    }
+    info->freeBlocks = nblocks;
+    info->freeHint = 0;
+    info->transfers = 0;
     return(info);
 }
 
-// Set the current device tail pointer to next
-int SetDevicePositionToNext(uint32_t deviceId) {
-    if (deviceInfo[deviceId]->currentBlock == deviceInfo[deviceId]->deviceBlocksSize - 1
-        && deviceInfo[deviceId]->currentSector < deviceInfo[deviceId]->deviceSectorsSize - 1) {
-        deviceInfo[deviceId]->currentBlock = 0;
-        deviceInfo[deviceId]->currentSector++;
-    } else if (deviceInfo[deviceId]->currentSector <= deviceInfo[deviceId]->deviceSectorsSize - 1 &&
-                deviceInfo[deviceId]->currentBlock < deviceInfo[deviceId]->deviceBlocksSize - 1) {
-        deviceInfo[deviceId]->currentBlock++;
+// Add a new (zeroed) file to a device's file table, doubling the table when
+// it is full. NULL on failure.
+LcFileInfo *LCNewFileInfo(uint32_t deviceId) {
+
+    LcDeviceInfo *info = deviceInfo[deviceId];
+    if (info->currentCount == info->fileInfoSize) {
+        uint32_t size = (info->fileInfoSize == 0) ? LC_DEVICE_FILES : info->fileInfoSize * 2;
+        LcFileInfo **table = realloc(info->fileInfoArray, size * sizeof(LcFileInfo *));
+        if (table == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "Failed to grow file table of device %u to %u files", deviceId, size);
+            return(NULL);
+        }
+        info->fileInfoArray = table;
+        info->fileInfoSize = size;
+    }
+    LcFileInfo *fileInfo = calloc(1, sizeof(LcFileInfo));
+    if (fileInfo == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to allocate file info for device %u", deviceId);
+        return(NULL);
+    }
+    fileInfo->tableIndex = info->currentCount;
+    info->fileInfoArray[info->currentCount++] = fileInfo;
+    return(fileInfo);
+}
+
+// Take a free block of a device from its bitmap, searching on from the last
+// block taken so a file's blocks stay in order. -1 if the device is full.
+int LCAllocBlock(uint32_t deviceId, uint32_t *sector, uint32_t *block) {
+
+    LcDeviceInfo *info = deviceInfo[deviceId];
+    uint32_t nblocks = info->deviceSectorsSize * info->deviceBlocksSize;
+    uint32_t nwords = (nblocks + 63) / 64;
+    if (info->freeBlocks == 0) {
+        info->isFull = 1;
+        return(-1);
+    }
+    uint32_t word = (info->freeHint < nblocks) ? info->freeHint / 64 : 0;
+    while (info->freeMap[word] == UINT64_MAX) {
+        word = (word + 1) % nwords;
+    }
+    uint32_t index = word * 64 + __builtin_ctzll(~info->freeMap[word]);
+    info->freeMap[word] |= (uint64_t)1 << (index % 64);
+    info->freeBlocks--;
+    info->freeHint = index + 1;
+    if (info->freeBlocks == 0) {
+        info->isFull = 1;
+    }
+    *sector = index / info->deviceBlocksSize;
+    *block = index % info->deviceBlocksSize;
+    return(0);
+}
+
+// Take a free block for a file's logical block: on the device its previous
+// block is on (or the stripe's device) or, if that one is full, on another
+// device
+int LCAllocFileBlock(LcFileInfo *fileInfo, uint32_t index, LcBlockAddr *addr) {
+
+    if (stripeBlocks > 0) {
+        addr->device = LCStripeDevice(fileInfo, index);
     } else {
-        // The device is full, set the pointer to the next sector.
-        //printf("Is FUll\n");
-        deviceInfo[deviceId]->isFull = 1;
-        return (-1);
+        addr->device = (index > 0) ? fileInfo->blockMap[index - 1].device : fileInfo->start_device;
+    }
+    if (LCAllocBlock(addr->device, &addr->sector, &addr->block) == 0) {
+        return(0);
+    }
+    addr->device = LCPlaceDevice(fileInfo->path, addr->device);
+    if (addr->device < 16 && LCAllocBlock(addr->device, &addr->sector, &addr->block) == 0) {
+        return(0);
+    }
+    logMessage(LOG_ERROR_LEVEL, "No free blocks left on any device for [%s]", fileInfo->path);
+    return(-1);
+}
+
+// Take a free block for a file's layout on the given device or, if that one
+// is full, on the device the placement policy picks. -1 if none has room.
+int LCAllocLayoutBlock(const char *path, uint32_t deviceId, LcBlockAddr *addr) {
+
+    addr->device = deviceId;
+    if (LCAllocBlock(addr->device, &addr->sector, &addr->block) == 0) {
+        return(0);
     }
-    return (1);
+    addr->device = LCPlaceDevice(path, deviceId);
+    if (addr->device < 16 && LCAllocBlock(addr->device, &addr->sector, &addr->block) == 0) {
+        return(0);
+    }
+    logMessage(LOG_ERROR_LEVEL, "No free blocks left on any device for the layout of [%s]", path);
+    return(-1);
 }
 
-uint32_t GetNextDeviceId(uint32_t deviceId) {
-    for (int i = 0; i < 16; i ++) {
+// Get the device a striped file's logical block goes on: stripes of
+// stripeBlocks blocks go round-robin over the devices, starting with the
+// file's first device
+uint32_t LCStripeDevice(LcFileInfo *fileInfo, uint32_t index) {
+
+    uint32_t devices[16], ndevices = 0, first = 0;
+    for (uint32_t i = 0; i < 16; i++) {
         if (deviceInfo[i] != NULL) {
-            // If the device is not full
-            if (deviceInfo[i]->isFull == 0 && deviceId != i) {
-                return (i);
+            if (i == fileInfo->start_device) {
+                first = ndevices;
             }
+            devices[ndevices++] = i;
+        }
+    }
+    uint32_t stripe = first + index / stripeBlocks;
+
+    // Full devices are passed over
+    for (uint32_t i = 0; i < ndevices; i++) {
+        uint32_t device = devices[(stripe + i) % ndevices];
+        if (!deviceInfo[device]->isFull) {
+            return(device);
+        }
+    }
+    return(fileInfo->start_device);
+}
+
+// Reserve a run of contiguous free blocks of a device (first fit). -1 if
+// the device has no run that long.
+int LCAllocRun(uint32_t deviceId, uint32_t nblocks, uint32_t *start) {
+
+    LcDeviceInfo *info = deviceInfo[deviceId];
+    uint32_t total = info->deviceSectorsSize * info->deviceBlocksSize;
+    uint32_t runStart = 0, runLength = 0;
+    if (info->freeBlocks < nblocks) {
+        return(-1);
+    }
+    for (uint32_t index = 0; index < total && runLength < nblocks; index++) {
+        if (info->freeMap[index / 64] == UINT64_MAX) {
+            runLength = 0;
+            index |= 63;
+        } else if (info->freeMap[index / 64] & ((uint64_t)1 << (index % 64))) {
+            runLength = 0;
+        } else if (runLength++ == 0) {
+            runStart = index;
         }
     }
-    return(20);
-}
\ No newline at end of file
+    if (runLength < nblocks) {
+        return(-1);
+    }
+    for (uint32_t index = runStart; index < runStart + nblocks; index++) {
+        info->freeMap[index / 64] |= (uint64_t)1 << (index % 64);
+    }
+    info->freeBlocks -= nblocks;
+    if (info->freeBlocks == 0) {
+        info->isFull = 1;
+    }
+    *start = runStart;
+    return(0);
+}
+
+// Give a block back to its device's bitmap and drop it from the cache
+void LCFreeBlock(uint32_t deviceId, uint32_t sector, uint32_t block) {
+
+    LcDeviceInfo *info = deviceInfo[deviceId];
+    uint32_t index = sector * info->deviceBlocksSize + block;
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    if (!(info->freeMap[index / 64] & bit)) {
+        return;
+    }
+    info->freeMap[index / 64] &= ~bit;
+    info->freeBlocks++;
+    info->isFull = 0;
+    lcloud_dropcache(deviceId, sector, block);
+}
+
+// Give back the data blocks reserved for a new file that failed to open:
+// its preallocated run, or its single first block
+void LCFreeReserved(uint32_t deviceId, uint32_t run, uint32_t start, uint32_t sector, uint32_t block) {
+
+    uint32_t blocks = deviceInfo[deviceId]->deviceBlocksSize;
+    if (run <= 1) {
+        LCFreeBlock(deviceId, sector, block);
+    }
+    for (uint32_t n = 0; run > 1 && n < run; n++) {
+        LCFreeBlock(deviceId, (start + n) / blocks, (start + n) % blocks);
+    }
+}
+
+// Pick a device with room for a new file, or for a file spilling over from
+// a full device, with the placement policy. 16 or more if none has room.
+uint32_t LCPlaceDevice(const char *path, uint32_t exclude) {
+
+    uint32_t devices[16], ndevices = 0;
+    for (uint32_t i = 0; i < 16; i++) {
+        if (deviceInfo[i] != NULL && !deviceInfo[i]->isFull && i != exclude) {
+            devices[ndevices++] = i;
+        }
+    }
+    if (ndevices == 0) {
+        return(20);
+    }
+    if (placement == LC_PLACE_HASH) {
+        return(devices[LCPathHash(path) % ndevices]);
+    }
+
+    // Least transfers (ties go to the most free blocks) or most free blocks
+    uint32_t best = devices[0];
+    for (uint32_t n = 1; n < ndevices && placement != LC_PLACE_FIRST; n++) {
+        LcDeviceInfo *info = deviceInfo[devices[n]];
+        if ((placement == LC_PLACE_LOAD && info->transfers < deviceInfo[best]->transfers) ||
+            ((placement == LC_PLACE_FREE || info->transfers == deviceInfo[best]->transfers) &&
+             info->freeBlocks > deviceInfo[best]->freeBlocks)) {
+            best = devices[n];
+        }
+    }
+    return(best);
+}
@@ -16,27 +16,58 @@
 #include <stdint.h>
 
 // Defines 
+#define LC_OPEN_PREALLOC 0x1 // Reserve contiguous blocks for the size hint
 
 // Type definitions
 typedef int32_t LcFHandle;
 
+typedef struct LcIoVec {
+    char *buf;      // Data of the range
+    size_t len;     // Bytes in the range
+    size_t off;     // Offset within the file the range starts at
+} LcIoVec;
+
 // File system interface definitions
 
 LcFHandle lcopen( const char *path );
     // Open the file for for reading and writing
 
+LcFHandle lcopen_ex( const char *path, size_t size, uint32_t flags );
+    // Open the file with the size it is expected to grow to and flags
+
 int lcread( LcFHandle fh, char *buf, size_t len );
     // Read data from the file hande
 
 int lcwrite( LcFHandle fh, char *buf, size_t len );
     // Write data to the file
 
+int lcpread( LcFHandle fh, char *buf, size_t len, size_t off );
+    // Read data from the file at an offset, not moving the file position
+
+int lcpwrite( LcFHandle fh, char *buf, size_t len, size_t off );
+    // Write data to the file at an offset, not moving the file position
+
+int lcreadv( LcFHandle fh, const LcIoVec *iov, int iovcnt );
+    // Read several ranges of the file, not moving the file position
+
+int lcwritev( LcFHandle fh, const LcIoVec *iov, int iovcnt );
+    // Write several ranges of the file, not moving the file position
+
 int lcseek( LcFHandle fh, size_t off );
     // Seek to a specific place in the file
 
 int lcclose( LcFHandle fh );
     // Close the file
 
+int lctruncate( LcFHandle fh, size_t len );
+    // Shorten the file, freeing the blocks past its new end
+
+int lcunlink( const char *path );
+    // Delete a file that is not open and free its blocks
+
+long lcfreeblocks( void );
+    // Count the free blocks on the devices
+
 int lcshutdown( void );
     // Shut down the filesystem
 
@@ -0,0 +1,479 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_mrc.c
+//  Description    : This is an offline miss-ratio-curve tool for the LionCloud
+//                   block cache. It replays workload files as the stream of
+//                   block references the filesystem would make, computes
+//                   the full LRU curve in one pass from stack distances, and
+//                   runs each cache policy at a list of sizes. Results are
+//                   written as CSV (hit rates, reuse distance and
+//                   sequentiality histograms).
+//
+//   Author        : Patrick McDaniel
+//   Last Modified : Thu 19 Mar 2020 09:27:55 AM EDT
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <glob.h>
+#include <unistd.h>
+
+// Project Includes
+#include <cmpsc311_assocarr.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_workload.h>
+#include <lcloud_controller.h>
+#include <lcloud_cache.h>
+
+// Defines
+#define LCLOUD_MRC_ARGUMENTS "hco:s:"
+#define LCLOUD_MRC_WORKLOADS "workload/*-workload.txt"
+#define LCLOUD_MRC_PAYLOAD LC_DEVICE_BLOCK_SIZE // File bytes per block (blocks have no header)
+#define LCLOUD_MRC_MAXSIZES 32
+#define LCLOUD_MRC_REUSEBINS 24      // log2 buckets of the reuse distance
+#define USAGE                                                          \
+    "USAGE: lcloud_mrc [-h] [-c] [-o <dir>] [-s <sizes>] [workload ...]\n" \
+    "\n"                                                               \
+    "where:\n"                                                         \
+    "    -h - help mode (display this message)\n"                      \
+    "    -c - include the chain walk of each seek (old chained format)\n" \
+    "    -o - directory for mrc.csv, reuse.csv and seq.csv (default .)\n" \
+    "    -s - comma separated cache sizes (blocks) to run policies at\n" \
+    "\n"                                                               \
+    "    workload - workload files (default all in workload/)\n"       \
+    "\n"
+
+// Sequentiality classes (block of a reference relative to the previous
+// reference to the same file)
+typedef enum {
+    MRC_SEQ_SAME     = 0,   // Same block again
+    MRC_SEQ_NEXT     = 1,   // The next block
+    MRC_SEQ_FORWARD  = 2,   // A short skip forward (2..8 blocks)
+    MRC_SEQ_JUMP     = 3,   // A long skip forward
+    MRC_SEQ_BACKWARD = 4,   // Any block behind
+    MRC_SEQ_FIRST    = 5,   // First reference to the file
+    MRC_SEQ_MAX      = 6
+} mrcSeqClass;
+
+static const char *mrcSeqLabels[MRC_SEQ_MAX] = {
+    "same", "next", "forward", "jump", "backward", "first"
+};
+
+// A file of the workload and the blocks it has been given
+typedef struct mrcFile {
+    char *name;
+    uint32_t *blocks;           // Block number of each logical block
+    uint32_t nblocks;
+    uint32_t capacity;
+    uint32_t pos;               // Current position (bytes)
+    int64_t last;               // Logical block of the previous reference
+    struct mrcFile *next;       // Next file of the workload
+} mrcFile;
+
+// The block reference stream of one workload
+typedef struct {
+    uint32_t *refs;             // Block numbers, in reference order
+    uint32_t nrefs;
+    uint32_t capacity;
+    uint32_t nblocks;           // Blocks allocated (distinct addresses)
+    uint64_t seq[MRC_SEQ_MAX];  // Sequentiality histogram
+} mrcStream;
+
+// Default cache sizes (in blocks) the policies are run at
+static const int mrcSizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+
+//
+// Functional Prototypes
+
+int mrcReadStream(const char *wload, mrcStream *stream, int chains); // Build references
+
+int mrcStackDistances(mrcStream *stream, uint64_t *hist); // LRU stack distances
+
+int mrcRunPolicy(mrcStream *stream, LcCachePolicyType policy, int size, uint64_t *hits); // Replay
+
+//
+// Functions
+
+// Spread a block number over the (did, sec, blk) space
+static void mrcAddress(uint32_t n, LcDeviceId *did, uint16_t *sec, uint16_t *blk) {
+    *did = (LcDeviceId)(n % 16);
+    *sec = (uint16_t)((n / 16) / 64);
+    *blk = (uint16_t)((n / 16) % 64);
+}
+
+// Get the log2 bucket of a reuse distance
+static int mrcReuseBin(uint64_t dist) {
+    int bin = 0;
+    while (dist > 0 && bin < LCLOUD_MRC_REUSEBINS - 1) {
+        dist >>= 1;
+        bin ++;
+    }
+    return(bin);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the miss-ratio-curve tool
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful test, -1 if failure
+
+int main(int argc, char* argv[])
+{
+    int ch, chains = 0, nsizes = 0, sizes[LCLOUD_MRC_MAXSIZES];
+    const char *outdir = ".";
+    char path[1024], *tok;
+    FILE *mrc, *reuse, *seq;
+    glob_t files;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, LCLOUD_MRC_ARGUMENTS)) != -1) {
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'c': // Count the chain walk of seeks
+            chains = 1;
+            break;
+
+        case 'o': // Output directory
+            outdir = optarg;
+            break;
+
+        case 's': // Cache sizes for the policy runs
+            for (tok = strtok(optarg, ","); tok != NULL && nsizes < LCLOUD_MRC_MAXSIZES;
+                 tok = strtok(NULL, ",")) {
+                if ((sizes[nsizes++] = atoi(tok)) <= 0) {
+                    fprintf(stderr, "Bad cache size [%s], aborting.\n", tok);
+                    return (-1);
+                }
+            }
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+    if (nsizes == 0) {
+        for (nsizes = 0; nsizes < sizeof(mrcSizes) / sizeof(mrcSizes[0]); nsizes++) {
+            sizes[nsizes] = mrcSizes[nsizes];
+        }
+    }
+
+    // Use the named workloads, or every workload in workload/
+    memset(&files, 0, sizeof(files));
+    if (optind < argc) {
+        files.gl_pathc = argc - optind;
+        files.gl_pathv = &argv[optind];
+    } else if (glob(LCLOUD_MRC_WORKLOADS, 0, NULL, &files) != 0) {
+        fprintf(stderr, "No workloads found [%s], aborting.\n", LCLOUD_MRC_WORKLOADS);
+        return (-1);
+    }
+
+    initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    snprintf(path, sizeof(path), "%s/mrc.csv", outdir);
+    mrc = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s/reuse.csv", outdir);
+    reuse = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s/seq.csv", outdir);
+    seq = fopen(path, "w");
+    if (mrc == NULL || reuse == NULL || seq == NULL) {
+        fprintf(stderr, "Cannot create output files in [%s], aborting.\n", outdir);
+        return (-1);
+    }
+    fprintf(mrc, "workload,policy,method,size,hit_rate\n");
+    fprintf(reuse, "workload,distance_min,distance_max,references\n");
+    fprintf(seq, "workload,class,references\n");
+
+    for (size_t w = 0; w < files.gl_pathc; w++) {
+        const char *wload = files.gl_pathv[w];
+        mrcStream stream;
+        if (mrcReadStream(wload, &stream, chains)) {
+            fprintf(stderr, "Skipping unreadable workload [%s].\n", wload);
+            continue;
+        }
+
+        // Full LRU curve: a reference hits in every cache larger than its
+        // stack distance (distance nblocks marks a cold miss)
+        uint64_t *hist = calloc(stream.nblocks + 1, sizeof(uint64_t));
+        uint64_t bins[LCLOUD_MRC_REUSEBINS] = { 0 }, hits = 0;
+        if (hist == NULL || mrcStackDistances(&stream, hist)) {
+            fprintf(stderr, "Stack distance pass failed [%s], aborting.\n", wload);
+            return (-1);
+        }
+        for (uint32_t size = 1; size <= stream.nblocks; size++) {
+            hits += hist[size - 1];
+            fprintf(mrc, "%s,lru,stack,%u,%.6f\n", wload, size,
+                stream.nrefs ? (double)hits / stream.nrefs : 0.0);
+        }
+
+        // Policies run through the real cache at the chosen sizes
+        for (int p = 0; p < LC_CACHE_MAXPOLICY; p++) {
+            for (int i = 0; i < nsizes; i++) {
+                if (mrcRunPolicy(&stream, (LcCachePolicyType)p, sizes[i], &hits)) {
+                    return (-1);
+                }
+                fprintf(mrc, "%s,%s,sim,%d,%.6f\n", wload, LC_CACHE_POLICY_LABELS[p], sizes[i],
+                    stream.nrefs ? (double)hits / stream.nrefs : 0.0);
+            }
+        }
+
+        // Reuse distance histogram (log2 buckets) and cold misses
+        for (uint32_t d = 0; d < stream.nblocks; d++) {
+            bins[mrcReuseBin(d)] += hist[d];
+        }
+        for (int b = 0; b < LCLOUD_MRC_REUSEBINS; b++) {
+            if (bins[b] > 0) {
+                fprintf(reuse, "%s,%llu,%llu,%llu\n", wload, (b == 0) ? 0ULL : 1ULL << (b - 1),
+                    (b == 0) ? 0ULL : (1ULL << b) - 1, (unsigned long long)bins[b]);
+            }
+        }
+        fprintf(reuse, "%s,cold,cold,%llu\n", wload, (unsigned long long)hist[stream.nblocks]);
+        for (int s = 0; s < MRC_SEQ_MAX; s++) {
+            fprintf(seq, "%s,%s,%llu\n", wload, mrcSeqLabels[s], (unsigned long long)stream.seq[s]);
+        }
+
+        printf("%s: %u references, %u blocks\n", wload, stream.nrefs, stream.nblocks);
+        free(hist);
+        free(stream.refs);
+    }
+
+    fclose(mrc);
+    fclose(reuse);
+    fclose(seq);
+    if (optind >= argc) {
+        globfree(&files);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrcReference
+// Description  : Add the reference to one logical block of a file, giving
+//                the block an address the first time it is touched (as the
+//                filesystem allocates blocks in order of first write)
+//
+// Inputs       : stream - the reference stream
+//                file - the file
+//                lblock - the logical block in the file
+// Outputs      : 0 if successful, -1 if failure
+
+static int mrcReference(mrcStream *stream, mrcFile *file, uint32_t lblock) {
+    while (file->nblocks <= lblock) {
+        if (file->nblocks == file->capacity) {
+            file->capacity = file->capacity ? file->capacity * 2 : 16;
+            if ((file->blocks = realloc(file->blocks, file->capacity * sizeof(uint32_t))) == NULL) {
+                return(-1);
+            }
+        }
+        file->blocks[file->nblocks++] = stream->nblocks++;
+    }
+    if (stream->nrefs == stream->capacity) {
+        stream->capacity = stream->capacity ? stream->capacity * 2 : 4096;
+        if ((stream->refs = realloc(stream->refs, stream->capacity * sizeof(uint32_t))) == NULL) {
+            return(-1);
+        }
+    }
+    stream->refs[stream->nrefs++] = file->blocks[lblock];
+
+    // Classify against the previous reference to the file
+    int64_t delta = (int64_t)lblock - file->last;
+    mrcSeqClass cls = (file->last < 0) ? MRC_SEQ_FIRST : (delta == 0) ? MRC_SEQ_SAME :
+        (delta == 1) ? MRC_SEQ_NEXT : (delta < 0) ? MRC_SEQ_BACKWARD :
+        (delta <= 8) ? MRC_SEQ_FORWARD : MRC_SEQ_JUMP;
+    stream->seq[cls] ++;
+    file->last = lblock;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrcReadStream
+// Description  : Read a workload and turn it into the block references the
+//                filesystem makes: every block a read or write covers (a
+//                write reads the block first, so it is one reference), the
+//                first block at open and, with chains, every block a seek
+//                walks from the start of the file
+//
+// Inputs       : wload - the workload file
+//                stream - the stream to fill
+//                chains - 1 to include the seek chain walks
+// Outputs      : 0 if successful, -1 if failure
+
+int mrcReadStream(const char *wload, mrcStream *stream, int chains) {
+    workload_state state;
+    static workload_operation operation;
+    AssocArray files;
+    mrcFile *file, *head = NULL;
+    int ret = 0;
+
+    memset(stream, 0, sizeof(mrcStream));
+    init_assoc(&files, stringCompareCallback, pointerCompareCallback);
+    if (openCmpsc311Workload(&state, wload)) {
+        return(-1);
+    }
+
+    do {
+        if (readCmpsc311Workload(&state, &operation)) {
+            ret = -1;
+            break;
+        }
+        if (operation.op == WL_EOF) {
+            break;
+        }
+        if ((file = find_assoc(&files, operation.objname)) == NULL) {
+            if ((file = calloc(1, sizeof(mrcFile))) == NULL) {
+                ret = -1;
+                break;
+            }
+            file->name = strdup(operation.objname);
+            file->last = -1;
+            file->next = head;
+            head = file;
+            insert_assoc(&files, file->name, file);
+        }
+
+        switch (operation.op) {
+        case WL_OPEN: // Open places the file on its first block
+            file->pos = 0;
+            ret = mrcReference(stream, file, 0);
+            break;
+
+        case WL_READ:
+        case WL_WRITE:
+            if (chains && file->pos != operation.pos) {
+                for (uint32_t b = 0; b < operation.pos / LCLOUD_MRC_PAYLOAD && ret == 0; b++) {
+                    ret = mrcReference(stream, file, b);
+                }
+            }
+            if (operation.size > 0) {
+                for (uint32_t b = operation.pos / LCLOUD_MRC_PAYLOAD;
+                     b <= (operation.pos + operation.size - 1) / LCLOUD_MRC_PAYLOAD && ret == 0; b++) {
+                    ret = mrcReference(stream, file, b);
+                }
+            }
+            file->pos = operation.pos + operation.size;
+            break;
+
+        default: // Close has no block references
+            break;
+        }
+    } while (ret == 0);
+
+    // Release the per-file state, the stream keeps the block numbers
+    clear_assoc(&files, 0, 0);
+    while ((file = head) != NULL) {
+        head = file->next;
+        free(file->name);
+        free(file->blocks);
+        free(file);
+    }
+    closeCmpsc311Workload(&state);
+    return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrcStackDistances
+// Description  : Compute the LRU stack distance of every reference in one
+//                pass. A Fenwick tree over reference times marks the last
+//                reference to each block, so the distance is the number of
+//                marks after the block's previous reference (O(n log n)).
+//
+// Inputs       : stream - the reference stream
+//                hist - histogram to fill, hist[d] for distance d and
+//                       hist[nblocks] for cold misses
+// Outputs      : 0 if successful, -1 if failure
+
+int mrcStackDistances(mrcStream *stream, uint64_t *hist) {
+    uint32_t n = stream->nrefs;
+    uint32_t *tree = calloc(n + 1, sizeof(uint32_t));
+    int64_t *last = malloc(stream->nblocks * sizeof(int64_t));
+    uint32_t marks = 0;
+
+    if (tree == NULL || last == NULL) {
+        free(tree);
+        free(last);
+        return(-1);
+    }
+    for (uint32_t b = 0; b < stream->nblocks; b++) {
+        last[b] = -1;
+    }
+
+    for (uint32_t t = 0; t < n; t++) {
+        uint32_t b = stream->refs[t];
+        if (last[b] < 0) {
+            hist[stream->nblocks] ++;
+        } else {
+            // Marks at or before the previous reference
+            uint32_t before = 0;
+            for (int64_t i = last[b] + 1; i > 0; i -= i & -i) {
+                before += tree[i];
+            }
+            hist[marks - before] ++;
+            for (int64_t i = last[b] + 1; i <= n; i += i & -i) {
+                tree[i] --;
+            }
+            marks --;
+        }
+        for (int64_t i = t + 1; i <= n; i += i & -i) {
+            tree[i] ++;
+        }
+        marks ++;
+        last[b] = t;
+    }
+    free(tree);
+    free(last);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrcRunPolicy
+// Description  : Replay the stream through the cache with one policy and
+//                size (read, insert on a miss) and count the hits
+//
+// Inputs       : stream - the reference stream
+//                policy - the replacement policy
+//                size - the cache size in blocks
+//                hits - place to put the number of hits
+// Outputs      : 0 if successful, -1 if failure
+
+int mrcRunPolicy(mrcStream *stream, LcCachePolicyType policy, int size, uint64_t *hits) {
+    char block[LC_DEVICE_BLOCK_SIZE];
+    LcCacheConfig cfg;
+    LcCacheStats stats;
+    LcDeviceId did;
+    uint16_t sec, blk;
+
+    // One shard and no snapshot, so the run is exactly the policy
+    memset(block, 0, sizeof(block));
+    if (lcloud_cacheconfig(&cfg, size)) {
+        return(-1);
+    }
+    cfg.nshards = 1;
+    cfg.policy = policy;
+    cfg.snapshot = NULL;
+    if (lcloud_initcache_config(&cfg)) {
+        fprintf(stderr, "Cache init failed for %d blocks, aborting.\n", size);
+        return(-1);
+    }
+    for (uint32_t i = 0; i < stream->nrefs; i++) {
+        mrcAddress(stream->refs[i], &did, &sec, &blk);
+        if (lcloud_readcache(did, sec, blk, block) != 0) {
+            lcloud_putcache(did, sec, blk, block);
+        }
+    }
+    lcloud_cache_stats(&stats);
+    *hits = stats.total.hits;
+    lcloud_closecache();
+    return(0);
+}
@@ -17,38 +17,57 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 // Project Includes
+#include <lcloud_cache.h>
 #include <lcloud_controller.h>
 #include <lcloud_filesys.h>
 #include <lcloud_support.h>
 
 // Defines
-#define LCLOUD_ARGUMENTS "hvl:x:"
-#define USAGE                                                       \
-    "USAGE: lcloud_sim [-h] [-v] [-l <logfile>] <workload-file>\n"  \
-    "\n"                                                            \
-    "where:\n"                                                      \
-    "    -h - help mode (display this message)\n"                   \
-    "    -v - verbose output\n"                                     \
-    "    -l - write log messages to the filename <logfile>\n"       \
-    "\n"                                                            \
-    "    <workload-file> - file contain the workload to simulate\n" \
+#define LCLOUD_ARGUMENTS "hvpacl:x:"
+#define LCLOUD_CHECK_SIZE 1024 // Bytes of the file the I/O check writes
+#define LCLOUD_CHECK_BLOCKS 10 // Blocks of the file the truncate/unlink check writes
+#define USAGE                                                                     \
+    "USAGE: lcloud_sim [-h] [-v] [-p] [-a] [-c] [-l <logfile>] <workload-file>\n" \
+    "\n"                                                                          \
+    "where:\n"                                                                    \
+    "    -h - help mode (display this message)\n"                                 \
+    "    -v - verbose output\n"                                                   \
+    "    -p - positional I/O (lcpread/lcpwrite, no seeks)\n"                      \
+    "    -a - preallocate each file for the size in the workload\n"               \
+    "         header (lcopen_ex with LC_OPEN_PREALLOC)\n"                         \
+    "    -c - check the positional, vectored, truncate and unlink\n"              \
+    "         calls instead of running a workload\n"                              \
+    "    -l - write log messages to the filename <logfile>\n"                     \
+    "\n"                                                                          \
+    "    <workload-file> - file contain the workload to simulate\n"               \
     "\n"
 
 //
 // Global Data
 int verbose;
+int positionalIO; // Read and write at the op position rather than seeking
+int preallocate;  // Open files with the size they grow to, preallocated
 
 //
 // Functional Prototypes
 
 int simulateLionCloud(char* wload); // LionCloud simulation
 
+int loadObjectSizes(char* wload, AssocArray* sizes); // Object sizes from the workload header
+
+int checkLionCloudIO(void); // Check the positional and vectored I/O calls
+
+int checkLionCloudFiles(void); // Check truncating, deleting and recreating files
+
+int checkResult(const char* what, int got, int expected); // Log a result that is not the one expected
+
 //
 // Functions
 
@@ -65,7 +84,7 @@ int main(int argc, char* argv[])
 {
 
     // Local variables
-    int ch, verbose = 0, log_initialized = 0;
+    int ch, verbose = 0, log_initialized = 0, check = 0;
 
     // Process the command line parameters
     while ((ch = getopt(argc, argv, LCLOUD_ARGUMENTS)) != -1) {
@@ -79,6 +98,18 @@ int main(int argc, char* argv[])
             verbose = 1;
             break;
 
+        case 'p': // Positional I/O
+            positionalIO = 1;
+            break;
+
+        case 'a': // Preallocate files
+            preallocate = 1;
+            break;
+
+        case 'c': // Check the I/O calls
+            check = 1;
+            break;
+
         case 'l': // Set the log filename
             initializeLogWithFilename(optarg);
             log_initialized = 1;
@@ -102,6 +133,18 @@ int main(int argc, char* argv[])
         enableLogLevels(LcControllerLLevel | LcDriverLLevel | LcSimulatorLLevel);
     }
 
+    // Check the I/O calls rather than running a workload
+    if (check) {
+        if (checkLionCloudIO() == 0 && checkLionCloudFiles() == 0) {
+            logMessage(LOG_INFO_LEVEL, "LionCloud I/O check completed successfully!!!\n\n");
+        } else {
+            logMessage(LOG_INFO_LEVEL, "LionCloud I/O check failed.\n\n");
+        }
+        lcshutdown();
+        freeLogRegistrations();
+        return (0);
+    }
+
     // The filename should be the next option
     if (argv[optind] == NULL) {
         fprintf(stderr, "Missing command line parameters, use -h to see usage, aborting.\n");
@@ -145,13 +188,18 @@ int simulateLionCloud(char* wload)
     workload_state state;
     workload_operation operation;
     LcFHandle fh;
-    AssocArray fhTable;
-    char buf[LC_MAX_OPERATION_SIZE];
-    int opens, reads, writes, seeks, closes;
+    AssocArray fhTable, sizeTable;
+    size_t* objsize;
+    char buf[LC_MAX_OPERATION_SIZE + 1];
+    int opens = 0, reads = 0, writes = 0, seeks = 0, closes = 0;
     fsysdata* fdata;
 
     /* Init fh table, open the workload for processing */
     init_assoc(&fhTable, stringCompareCallback, pointerCompareCallback);
+    init_assoc(&sizeTable, stringCompareCallback, pointerCompareCallback);
+    if (preallocate) {
+        loadObjectSizes(wload, &sizeTable);
+    }
     if (openCmpsc311Workload(&state, wload)) {
         logMessage(LOG_ERROR_LEVEL, "CMPSC311 lcloud workload: failed opening workload [%s]", wload);
         return (-1);
@@ -181,8 +229,10 @@ int simulateLionCloud(char* wload)
 
         case WL_OPEN: /* Open the file for reading/writing, check error */
 
-            /* Open the file for reading */
-            if ((fh = lcopen(operation.objname)) == -1) {
+            /* Open the file for reading (preallocating the size the header gives if asked) */
+            objsize = find_assoc(&sizeTable, operation.objname);
+            if ((fh = (preallocate && objsize != NULL) ? lcopen_ex(operation.objname, *objsize, LC_OPEN_PREALLOC)
+                                                        : lcopen(operation.objname)) == -1) {
                 logMessage(LOG_ERROR_LEVEL, "CMPSC311 error opening file [%s], aborting", operation.objname);
                 return (-1);
             }
@@ -209,22 +259,24 @@ int simulateLionCloud(char* wload)
             }
 
             /* If the position within the file is not a read location, seek */
-            if (fdata->pos != operation.pos) {
+            if (!positionalIO && fdata->pos != operation.pos) {
                 if (lcseek(fdata->fhandle, operation.pos) != operation.pos) {
                     logMessage(LOG_ERROR_LEVEL, "CMPSC311 error seek failed [%s, pos=%d], aborting",
                         operation.objname, operation.pos);
                     return (-1);
                 }
-                fdata->pos = operation.pos;
                 seeks++;
             }
+            fdata->pos = operation.pos;
 
-            /* Now do the read from the file */
-            if (lcread(fdata->fhandle, buf, operation.size) != operation.size) {
+            /* Now do the read from the file (at the op position, with no seek, for positional I/O) */
+            if ((positionalIO ? lcpread(fdata->fhandle, buf, operation.size, operation.pos)
+                              : lcread(fdata->fhandle, buf, operation.size)) != operation.size) {
                 logMessage(LOG_ERROR_LEVEL, "CMPSC311 error read failed [%s, pos=%d, size=%d], aborting",
                     operation.objname, operation.pos, operation.size);
                 return (-1);
             }
+            buf[operation.size] = '\0';
 
             /* Compare the data read with that in the workload data */
             if (strncmp(buf, operation.data, operation.size) != 0) {
@@ -250,19 +302,20 @@ int simulateLionCloud(char* wload)
                 return (-1);
             }
 
-            /* If the position within the file is not a read location, seek */
-            if (fdata->pos != operation.pos) {
+            /* If the position within the file is not a write location, seek */
+            if (!positionalIO && fdata->pos != operation.pos) {
                 if (lcseek(fdata->fhandle, operation.pos) != operation.pos) {
                     logMessage(LOG_ERROR_LEVEL, "CMPSC311 error seek failed [%s, pos=%d], aborting",
                         operation.objname, operation.pos);
                     return (-1);
                 }
-                fdata->pos = operation.pos;
                 seeks++;
             }
+            fdata->pos = operation.pos;
 
-            /* Now do the write to the file */
-            if (lcwrite(fdata->fhandle, operation.data, operation.size) != operation.size) {
+            /* Now do the write to the file (at the op position, with no seek, for positional I/O) */
+            if ((positionalIO ? lcpwrite(fdata->fhandle, operation.data, operation.size, operation.pos)
+                              : lcwrite(fdata->fhandle, operation.data, operation.size)) != operation.size) {
                 logMessage(LOG_ERROR_LEVEL, "CMPSC311 error write failed [%s, pos=%d, size=%d], aborting",
                     operation.objname, operation.pos, operation.size);
                 return (-1);
@@ -302,6 +355,8 @@ int simulateLionCloud(char* wload)
         case WL_EOF: // End of the workload file
             lcshutdown();
             logMessage(LcSimulatorLLevel, "End of the workload file (processed)");
+            logMessage(LcSimulatorLLevel, "Workload: %d opens, %d reads, %d writes, %d seeks, %d closes",
+                opens, reads, writes, seeks, closes);
             break;
 
         default: /* Unknown oepration type, bailout */
@@ -319,5 +374,246 @@ int simulateLionCloud(char* wload)
 
     /* Log, close workload and delete the local file, return successfully  */
     closeCmpsc311Workload(&state);
+    clear_assoc(&sizeTable, 1, 1);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : loadObjectSizes
+// Description  : Read the object sizes from the "# Object: <name> (sz=<n>)"
+//                lines of the workload header, so files can be opened with
+//                the size they grow to.
+//
+// Inputs       : wload - the name of the workload file
+//                sizes - the table to add the name -> size entries to
+// Outputs      : number of sizes found, -1 if failure
+
+int loadObjectSizes(char* wload, AssocArray* sizes)
+{
+    FILE* fp;
+    char line[256], name[128];
+    size_t size;
+    int found = 0;
+
+    if ((fp = fopen(wload, "r")) == NULL) {
+        return (-1);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL && line[0] == '#') {
+        if (sscanf(line, "# Object: %127s (sz=%zu)", name, &size) == 2) {
+            size_t* value = malloc(sizeof(size_t));
+            *value = size;
+            insert_assoc(sizes, strdup(name), value);
+            found++;
+        }
+    }
+    fclose(fp);
+    return (found);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : checkLionCloudIO
+// Description  : Check the positional and vectored I/O calls on a scratch
+//                file: whole, empty, overlapping, short and bad ranges, and
+//                that none of them moves the file position.
+//
+// Inputs       : none
+// Outputs      : 0 if successful test, -1 if failure
+
+int checkLionCloudIO(void)
+{
+    static char name[64] = "lcloud-check-io";
+    char ref[LCLOUD_CHECK_SIZE], buf[LCLOUD_CHECK_SIZE + 1], tail[LCLOUD_CHECK_SIZE + 1];
+    LcFHandle fh;
+    int i;
+
+    /* Data no two nearby bytes of which match */
+    for (i = 0; i < LCLOUD_CHECK_SIZE; i++) {
+        ref[i] = 'a' + (i * 7 + i / 26) % 26;
+    }
+    if ((fh = lcopen(name)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "CMPSC311 I/O check: error opening file [%s]", name);
+        return (-1);
+    }
+
+    /* Write the file in ranges: one, an empty one, one to grow it, one over the first */
+    LcIoVec wv[] = {
+        { &ref[0], 300, 0 },
+        { &ref[300], 0, 300 },
+        { &ref[300], 700, 300 },
+        { &ref[500], 50, 100 },
+    };
+    if (checkResult("lcwritev", lcwritev(fh, wv, 4), 1050) ||
+        checkResult("lcwritev of a range past the end", lcwritev(fh, &(LcIoVec){ ref, 10, 2000 }, 1), -1) ||
+        checkResult("lcwritev of no ranges", lcwritev(fh, wv, 0), 0)) {
+        return (-1);
+    }
+    memcpy(&ref[100], &ref[500], 50);
+
+    /* Grow it the rest of the way at its end, and read past it */
+    if (checkResult("lcpwrite at the end", lcpwrite(fh, &ref[1000], 24, 1000), 24) ||
+        checkResult("lcpread at the end", lcpread(fh, buf, 10, LCLOUD_CHECK_SIZE), 0) ||
+        checkResult("lcpread past the end", lcpread(fh, buf, 10, LCLOUD_CHECK_SIZE + 1), -1) ||
+        checkResult("lcpread of the last bytes", lcpread(fh, buf, 24, 1000), 24) ||
+        checkResult("lcpread data", memcmp(buf, &ref[1000], 24), 0)) {
+        return (-1);
+    }
+
+    /* Read it back in ranges; the short one at the end stops the rest */
+    memset(tail, 'X', sizeof(tail));
+    LcIoVec rv[] = {
+        { &buf[0], 256, 0 },
+        { &buf[256], 744, 256 },
+        { &buf[1000], 50, 1000 },
+        { &tail[0], 10, 0 },
+    };
+    if (checkResult("lcreadv", lcreadv(fh, rv, 4), LCLOUD_CHECK_SIZE) ||
+        checkResult("lcreadv data", memcmp(buf, ref, LCLOUD_CHECK_SIZE), 0) ||
+        checkResult("lcreadv after a short range", tail[0], 'X') ||
+        checkResult("lcreadv of a range past the end", lcreadv(fh, &(LcIoVec){ buf, 10, 2000 }, 1), -1)) {
+        return (-1);
+    }
+
+    /* The file position has stayed at the start */
+    if (checkResult("lcread after positional I/O", lcread(fh, buf, 16), 16) ||
+        checkResult("lcread data", memcmp(buf, ref, 16), 0) ||
+        checkResult("lcclose", lcclose(fh), 0)) {
+        return (-1);
+    }
+
+    /* And the data is all there once the file is opened again */
+    if ((fh = lcopen(name)) == -1 ||
+        checkResult("lcseek", lcseek(fh, 0), 0) ||
+        checkResult("lcread after reopen", lcread(fh, buf, LCLOUD_CHECK_SIZE), LCLOUD_CHECK_SIZE) ||
+        checkResult("lcread data after reopen", memcmp(buf, ref, LCLOUD_CHECK_SIZE), 0) ||
+        checkResult("lcclose", lcclose(fh), 0)) {
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : checkLionCloudFiles
+// Description  : Check truncating, deleting and recreating a scratch file:
+//                the data left, the blocks given back to the devices (and
+//                taken again), the cache lines of freed blocks dropped, and
+//                the path free for a new file once deleted. Run after
+//                checkLionCloudIO, whose opens probe the devices.
+//
+// Inputs       : none
+// Outputs      : 0 if successful test, -1 if failure
+
+int checkLionCloudFiles(void)
+{
+    static char name[64] = "lcloud-check-files";
+    static char missing[64] = "lcloud-check-missing";
+    char ref[LCLOUD_CHECK_BLOCKS * LC_DEVICE_BLOCK_SIZE], buf[LCLOUD_CHECK_BLOCKS * LC_DEVICE_BLOCK_SIZE + 1];
+    int size = LCLOUD_CHECK_BLOCKS * LC_DEVICE_BLOCK_SIZE;
+    LcCacheStats stats;
+    long empty, lines;
+    LcFHandle fh;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        ref[i] = 'A' + (i * 11 + i / 26) % 26;
+    }
+
+    /* A new file holds its first block and its layout block */
+    long before = lcfreeblocks();
+    if ((fh = lcopen(name)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "CMPSC311 file check: error opening file [%s]", name);
+        return (-1);
+    }
+    empty = lcfreeblocks();
+    if (checkResult("blocks taken by a new file", before - empty, 2) ||
+        checkResult("lcwrite", lcwrite(fh, ref, size), size) ||
+        checkResult("blocks taken by the write", empty - lcfreeblocks(), LCLOUD_CHECK_BLOCKS - 1)) {
+        return (-1);
+    }
+
+    /* Truncating gives back the blocks past the new end and drops their lines */
+    lcloud_cache_stats(&stats);
+    lines = stats.total.lines;
+    if (checkResult("lctruncate", lctruncate(fh, 600), 0) ||
+        checkResult("blocks held after lctruncate", empty - lcfreeblocks(), 2)) {
+        return (-1);
+    }
+    lcloud_cache_stats(&stats);
+    if (checkResult("cache lines dropped by lctruncate", lines - stats.total.lines, LCLOUD_CHECK_BLOCKS - 3) ||
+        checkResult("lctruncate past the end", lctruncate(fh, 601), -1) ||
+        checkResult("lcpread after lctruncate", lcpread(fh, buf, size, 0), 600) ||
+        checkResult("lcpread data after lctruncate", memcmp(buf, ref, 600), 0) ||
+        checkResult("lcpread past the new end", lcpread(fh, buf, 10, 601), -1)) {
+        return (-1);
+    }
+
+    /* Growing it again takes blocks back, with none of the old data in them */
+    if (checkResult("lcpwrite after lctruncate", lcpwrite(fh, &ref[1500], 1000, 600), 1000) ||
+        checkResult("blocks held after growing", empty - lcfreeblocks(), 6) ||
+        checkResult("lcpread of the regrown part", lcpread(fh, buf, 1000, 600), 1000) ||
+        checkResult("lcpread data of the regrown part", memcmp(buf, &ref[1500], 1000), 0) ||
+        checkResult("lctruncate to empty", lctruncate(fh, 0), 0) ||
+        checkResult("blocks held when empty", empty - lcfreeblocks(), 0) ||
+        checkResult("lcread when empty", lcread(fh, buf, 10), 0)) {
+        return (-1);
+    }
+
+    /* Deleting needs the file closed and gives every block back */
+    if (checkResult("lcwrite", lcwrite(fh, ref, size), size) ||
+        checkResult("lcunlink of an open file", lcunlink(name), -1) ||
+        checkResult("lcclose", lcclose(fh), 0)) {
+        return (-1);
+    }
+    lcloud_cache_stats(&stats);
+    lines = stats.total.lines;
+    if (checkResult("lcunlink", lcunlink(name), 0) ||
+        checkResult("blocks held after lcunlink", before - lcfreeblocks(), 0) ||
+        checkResult("lcunlink again", lcunlink(name), -1) ||
+        checkResult("lcunlink of a missing file", lcunlink(missing), -1)) {
+        return (-1);
+    }
+    lcloud_cache_stats(&stats);
+    if (checkResult("cache lines dropped by lcunlink", lines - stats.total.lines, LCLOUD_CHECK_BLOCKS + 1)) {
+        return (-1);
+    }
+
+    /* The path is free again: a new, empty file reusing the freed blocks */
+    if ((fh = lcopen(name)) == -1 ||
+        checkResult("lcread of the recreated file", lcread(fh, buf, 10), 0) ||
+        checkResult("lcwrite to the recreated file", lcwrite(fh, &ref[1000], 1000), 1000) ||
+        checkResult("blocks held by the recreated file", before - lcfreeblocks(), 5) ||
+        checkResult("lcclose", lcclose(fh), 0)) {
+        return (-1);
+    }
+    if ((fh = lcopen(name)) == -1 ||
+        checkResult("lcseek", lcseek(fh, 0), 0) ||
+        checkResult("lcread after reopen", lcread(fh, buf, size), 1000) ||
+        checkResult("lcread data after reopen", memcmp(buf, &ref[1000], 1000), 0) ||
+        checkResult("lcclose", lcclose(fh), 0) ||
+        checkResult("lcunlink", lcunlink(name), 0)) {
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : checkResult
+// Description  : Log a check whose result is not the one expected
+//
+// Inputs       : what - the call checked
+//                got - the result
+//                expected - the result expected
+// Outputs      : 0 if the result is the one expected, -1 if not
+
+int checkResult(const char* what, int got, int expected)
+{
+    if (got != expected) {
+        logMessage(LOG_ERROR_LEVEL, "CMPSC311 I/O check: %s gave %d, expected %d", what, got, expected);
+        return (-1);
+    }
+    logMessage(LcSimulatorLLevel, "I/O check: %s gave %d", what, got);
     return (0);
 }